@@ -30,6 +30,7 @@
 #include "hopfield.h"
 #include "image.h"
 #include "lambda.h"
+#include "multigrid.h"
 #include "blur.h"
 #include "gettext.h"
 
@@ -46,6 +47,15 @@
 #define LAMBDAMIN_USABLE_MAX	0.999
 #define LAMBDA_MAX		10000.0
 
+/* Linear buffers share the storage type of the image planes */
+#ifdef USE_FLOAT
+#define LINEAR_RGB		"RGB float"
+#define LINEAR_GRAY		"Y float"
+#else
+#define LINEAR_RGB		"RGB double"
+#define LINEAR_GRAY		"Y double"
+#endif
+
 #define RESPONSE_PREVIEW	1
 #define RESPONSE_RESET		2
 
@@ -55,6 +65,14 @@ enum {
   BOUNDARY_LAST
 };
 
+/* solver flags, they can be combined */
+enum {
+  SOLVER_SYNCHRONOUS = 1,
+  SOLVER_QUANTIZED   = 2,
+  SOLVER_FIXED_POINT = 4,
+  SOLVER_INCREMENTAL = 8
+};
+
 /* FORWARD DECLARATIONS */
 
 static void query(void);
@@ -76,7 +94,7 @@ static void input_parameters_init (void);
 static void input_parameters_destroy (void);
 static void input_parameters_load (void);
 static void input_parameters_save (void);
-static void input_parameters_fetch_params (const GimpParam *param);
+static void input_parameters_fetch_params (gint nparams, const GimpParam *param);
 static void input_parameters_fetch_dlg();
 static int  image_parameters_init (const GimpParam *param, GimpParam *values);
 static void image_parameters_destroy (void);
@@ -88,6 +106,8 @@ static void preview_parameters_init (void);
 static void preview_fetch_hopfield (void);
 static void preview_update (void);
 static void get_lambdas (gdouble *lambda, gdouble *lambda_min);
+static void hopfield_setup (hopfield_t *h, gboolean is_mirror);
+static weights_t* weights_update (void);
 static int compute (int iterations);
 static void motion_angle_draw (gboolean complete_redraw);
 static void motion_angle_xy_calculate (gdouble x, gdouble y);
@@ -132,7 +152,7 @@ typedef struct {
   guint          height;
   guint          size;
   guchar        *data;
-  gdouble       *linear;
+  real_t        *linear;
   const Babl    *rgb8;
 } SPreview;
 
@@ -148,6 +168,14 @@ typedef struct {
   guint          boundary;
   guint          adaptive_smooth;
   guint          prev_iter;
+  guint          levels;
+  guint          level_iter;
+  gdouble        tolerance;
+  gboolean       legacy_order;
+  guint          lambda_refresh;
+  guint          lambda_channels;
+  guint          solver;
+  gdouble        damping;
 } SInputParameters;
 
 typedef struct {
@@ -164,7 +192,7 @@ typedef struct {
   GimpDrawable  *drawable;
   GeglBuffer    *srcBuf;
   GeglBuffer    *destBuf;
-  gdouble       *srcImg;
+  real_t        *srcImg;
   guchar        *destImg;
   const Babl    *format;
   const Babl    *linear;
@@ -183,6 +211,8 @@ typedef struct {
   GtkAdjustment *winsize;
   GtkAdjustment *iterations;
   GtkAdjustment *prev_iter;
+  GtkAdjustment *levels;
+  GtkAdjustment *tolerance;
   GtkAdjustment *hscroll;
   GtkAdjustment *vscroll;
   gboolean       frun;
@@ -211,6 +241,12 @@ typedef struct {
   lambda_t       lambdafldR;
   lambda_t       lambdafldG;
   lambda_t       lambdafldB;
+  arena_t        arena;
+  weights_t      weights;
+  gdouble        weights_radius;
+  gdouble        weights_gauss;
+  gdouble        weights_motion;
+  gdouble        weights_mot_angle;
 } SHopfield;
 
 /* STATIC DATA */
@@ -333,7 +369,15 @@ static void query (void) {
     {GIMP_PDB_INT32, "adaptive_smooth", "Adaptive smoothing (default = TRUE)"},
     {GIMP_PDB_INT32, "winsize", "Smooth area size (default = 3)"},
     {GIMP_PDB_INT32, "iterations", "Number of iterations (default = 100)"},
-    {GIMP_PDB_INT32, "prev_iter", "Number of iterations for preview (default = 10)"}
+    {GIMP_PDB_INT32, "prev_iter", "Number of iterations for preview (default = 10)"},
+    {GIMP_PDB_INT32, "levels", "Coarse-to-fine pyramid levels, 0 = off (default = 0)"},
+    {GIMP_PDB_INT32, "level_iter", "Number of iterations per pyramid level (default = 20)"},
+    {GIMP_PDB_FLOAT, "tolerance", "Stop when energy decrease or changed pixels fall below this fraction, 0 disables early stopping (default = 0.001, scripts which leave it out keep 0)"},
+    {GIMP_PDB_INT32, "legacy_order", "Single-threaded sweep visiting the pixels column by column, like the old plug-in (default = FALSE)"},
+    {GIMP_PDB_INT32, "lambda_refresh", "Recompute adaptive smoothing every this many iterations (default = 1)"},
+    {GIMP_PDB_INT32, "lambda_channels", "Area smoothing of RGB images from 0 = each channel, 1 = luminance, 2 = brightest channel (default = 0)"},
+    {GIMP_PDB_INT32, "solver", "Solver flags: 1 = synchronous update, 2 = 8 bit state, 4 = fixed point taps, 8 = incremental local fields (default = 0)"},
+    {GIMP_PDB_FLOAT, "damping", "Step damping of the synchronous update, 0 = bound calculated from the blur (default = 0)"}
   };
 
 #ifdef HAVE_SETLOCALE
@@ -375,6 +419,14 @@ static void input_parameters_init (void) {
   input_parameters.prev_iter = 10;
   input_parameters.boundary = BOUNDARY_MIRROR;
   input_parameters.adaptive_smooth = TRUE;
+  input_parameters.levels = 0;
+  input_parameters.level_iter = 20;
+  input_parameters.tolerance = 0.001;
+  input_parameters.legacy_order = FALSE;
+  input_parameters.lambda_refresh = 1;
+  input_parameters.lambda_channels = 0;
+  input_parameters.solver = 0;
+  input_parameters.damping = 0.0;
 }
 
 static void input_parameters_load (void) {
@@ -385,7 +437,7 @@ static void input_parameters_save (void) {
   gimp_set_data (PACKAGE_NAME, &input_parameters, sizeof (input_parameters));
 }
 
-static void input_parameters_fetch_params (const GimpParam *param) {
+static void input_parameters_fetch_params (gint nparams, const GimpParam *param) {
   input_parameters.radius          = param[3].data.d_float;
   input_parameters.gauss           = param[4].data.d_float;
   input_parameters.motion          = param[5].data.d_float;
@@ -397,6 +449,23 @@ static void input_parameters_fetch_params (const GimpParam *param) {
   input_parameters.winsize         = param[11].data.d_int32;
   input_parameters.iterations      = param[12].data.d_int32;
   input_parameters.prev_iter       = param[13].data.d_int32;
+  /* newer parameters are optional, older scripts keep the defaults */
+  if (nparams > 14)
+    input_parameters.levels        = param[14].data.d_int32;
+  if (nparams > 15)
+    input_parameters.level_iter    = param[15].data.d_int32;
+  /* older scripts keep the fixed iteration count */
+  input_parameters.tolerance       = (nparams > 16 ? param[16].data.d_float : 0.0);
+  if (nparams > 17)
+    input_parameters.legacy_order  = param[17].data.d_int32;
+  if (nparams > 18)
+    input_parameters.lambda_refresh = param[18].data.d_int32;
+  if (nparams > 19)
+    input_parameters.lambda_channels = param[19].data.d_int32;
+  if (nparams > 20)
+    input_parameters.solver        = param[20].data.d_int32;
+  if (nparams > 21)
+    input_parameters.damping       = param[21].data.d_float;
 }
 
 static void input_parameters_fetch_dlg () {
@@ -410,6 +479,8 @@ static void input_parameters_fetch_dlg () {
   input_parameters.winsize         = (guint)(gtk_adjustment_get_value (dialog_parameters.winsize));
   input_parameters.iterations      = (guint)(gtk_adjustment_get_value (dialog_parameters.iterations));
   input_parameters.prev_iter       = (guint)(gtk_adjustment_get_value (dialog_parameters.prev_iter));
+  input_parameters.levels          = (guint)(gtk_adjustment_get_value (dialog_parameters.levels));
+  input_parameters.tolerance       = gtk_adjustment_get_value (dialog_parameters.tolerance);
   input_parameters.adaptive_smooth = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (dialog_elements.adaptive));
 }
 
@@ -423,6 +494,8 @@ static void dialog_parameters_init () {
   gtk_adjustment_set_value (dialog_parameters.winsize,    input_parameters.winsize);
   gtk_adjustment_set_value (dialog_parameters.iterations, input_parameters.iterations);
   gtk_adjustment_set_value (dialog_parameters.prev_iter,  input_parameters.prev_iter);
+  gtk_adjustment_set_value (dialog_parameters.levels,     input_parameters.levels);
+  gtk_adjustment_set_value (dialog_parameters.tolerance,  input_parameters.tolerance);
   dialog_parameters.area_smooth_enabled = TRUE;
 }
 
@@ -439,6 +512,8 @@ static void dialog_parameters_create () {
   dialog_parameters.winsize    = GTK_ADJUSTMENT (gtk_adjustment_new (input_parameters.winsize, 1.0, 16.0, 1.0, 1.0, 0.0));
   dialog_parameters.iterations = GTK_ADJUSTMENT (gtk_adjustment_new (input_parameters.iterations, 1.0, 200.0, 1.0, 10.0, 0.0));
   dialog_parameters.prev_iter  = GTK_ADJUSTMENT (gtk_adjustment_new (input_parameters.prev_iter, 1.0, 20.0, 1.0, 1.0, 0.0));
+  dialog_parameters.levels     = GTK_ADJUSTMENT (gtk_adjustment_new (input_parameters.levels, 0.0, MULTIGRID_MAX_LEVELS, 1.0, 1.0, 0.0));
+  dialog_parameters.tolerance  = GTK_ADJUSTMENT (gtk_adjustment_new (input_parameters.tolerance, 0.0, 0.1, 0.0001, 0.001, 0.0));
   dialog_parameters.hscroll    = GTK_ADJUSTMENT (gtk_adjustment_new (0.0, 0.0, image_parameters.sel_width - 1.0, 1.0, preview.width, preview.width));
   dialog_parameters.vscroll    = GTK_ADJUSTMENT (gtk_adjustment_new (0.0, 0.0, image_parameters.sel_height - 1.0, 1.0, preview.height, preview.height));
 
@@ -550,7 +625,7 @@ static void preview_parameters_init (void) {
   preview.size   = preview.width * preview.height;
   preview.rgb8   = babl_format (ret);
   preview.data   = g_new (guchar,  preview.size * 3);
-  preview.linear = g_new (gdouble, preview.size * (image_parameters.rgb ? 3:1));
+  preview.linear = g_new (real_t, preview.size * (image_parameters.rgb ? 3:1));
 }
 
 static int hopfield_data_init (void) {
@@ -563,11 +638,11 @@ static int hopfield_data_init (void) {
   image_parameters.format = gimp_drawable_get_format (drawable_ID);
   image_parameters.bppImg = bppImg = babl_format_get_bytes_per_pixel (image_parameters.format);
 
-  /* Load 'linear_double RGB' or 'linear_double Gray' into srcImg */
+  /* Load linear RGB or Gray in the storage type into srcImg */
   image_parameters.xImg = xImg = gimp_drawable_width(drawable_ID);
   image_parameters.yImg = yImg = gimp_drawable_height(drawable_ID);
   pixelCount = xImg * yImg;
-  if (!(image_parameters.srcImg = g_new (gdouble, pixelCount * (image_parameters.rgb ? 3:1))))
+  if (!(image_parameters.srcImg = g_new (real_t, pixelCount * (image_parameters.rgb ? 3:1))))
     goto hopfield_data_init_err0;
   if (!(image_parameters.destImg = g_new (guchar, pixelCount * bppImg)))
     goto hopfield_data_init_err1;
@@ -578,7 +653,7 @@ static int hopfield_data_init (void) {
   gegl_buffer_get (image_parameters.srcBuf, GEGL_RECTANGLE(0, 0, xImg, yImg), 1.0, \
                    image_parameters.format, image_parameters.destImg, \
                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
-  image_parameters.linear = babl_format ((image_parameters.rgb ? "RGB double":"Y double"));
+  image_parameters.linear = babl_format ((image_parameters.rgb ? LINEAR_RGB:LINEAR_GRAY));
   babl_process (babl_fish (image_parameters.format, image_parameters.linear), \
                 image_parameters.destImg, image_parameters.srcImg, \
                 pixelCount);
@@ -627,6 +702,7 @@ static void hopfield_data_destroy (void) {
     image_destroy (&hopfield.imageG);
   }
   image_destroy (&hopfield.imageR);
+  weights_destroy (&hopfield.weights);
 
   g_free (image_parameters.destImg);
   g_free (image_parameters.srcImg);
@@ -634,7 +710,7 @@ static void hopfield_data_destroy (void) {
 
 static void hopfield_data_save (void) {
   gint32   drawable_ID;
-  gdouble *ptr;
+  real_t  *ptr;
   gint     x, y, xImg, yImg;
 
   drawable_ID = image_parameters.drawable->drawable_id;
@@ -694,7 +770,7 @@ hopfield_data_save_err0:
 
 static void hopfield_data_load (void) {
   guint    x, y;
-  gdouble *ptr;
+  real_t  *ptr;
 
   ptr = image_parameters.srcImg;
   if (image_parameters.rgb) {
@@ -721,7 +797,7 @@ static void hopfield_data_load (void) {
 static void preview_fetch_hopfield (void) {
   guint    x, y;
   guint    w, h;
-  gdouble *ptr;
+  real_t  *ptr;
 
   w = preview.width + preview.x;
   h = preview.height + preview.y;
@@ -813,7 +889,7 @@ static GtkWidget *create_degradation_params () {
 
   frame = gtk_frame_new (_("Degradation"));
 
-  table = gtk_table_new (2, 7, FALSE);
+  table = gtk_table_new (2, 9, FALSE);
 
   /* blur radius */
   element = gtk_label_new (_("Radius:"));
@@ -875,14 +951,34 @@ static GtkWidget *create_degradation_params () {
   gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 5, 6);
   gtk_widget_show (element);
 
+  /* convergence tolerance */
+  element = gtk_label_new (_("Tolerance:"));
+  gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 6, 7);
+  gtk_widget_show (element);
+
+  element = scaler_new (dialog_parameters.tolerance, 0.0001f, 4);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 6, 7);
+  gtk_widget_show (element);
+
+  /* coarse-to-fine levels */
+  element = gtk_label_new (_("Pyramid levels:"));
+  gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 7, 8);
+  gtk_widget_show (element);
+
+  element = scaler_new (dialog_parameters.levels, 1, 0);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 7, 8);
+  gtk_widget_show (element);
+
   /* boundary */
   element = gtk_label_new (_("Boundary:"));
   gtk_misc_set_alignment (GTK_MISC (element), 1.0, 0.5);
-  gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 6, 7);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 0, 1, 8, 9);
   gtk_widget_show (element);
 
   element = dialog_elements.boundary = listbox_new (boundary_listbox, boundary_callback, input_parameters.boundary);
-  gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 6, 7);
+  gtk_table_attach_defaults (GTK_TABLE (table), element, 1, 2, 8, 9);
   gtk_widget_show (element);
 
   gtk_container_set_border_width (GTK_CONTAINER (table), 5);
@@ -1185,12 +1281,57 @@ static void progress_bar_reset () {
   }
 }
 
+/* The legacy order keeps the column by column visiting order of the old
+ * plug-in on a single thread. The random steps and the tap sums have
+ * changed since, so it does not reproduce old results bit for bit. */
+static void hopfield_setup (hopfield_t *h, gboolean is_mirror) {
+  hopfield_set_mirror (h, is_mirror);
+  hopfield_set_weights (h, &hopfield.weights);
+  /* the field costs an image of doubles per channel and pays off only
+   * when few pixels move per sweep, so it is left to the solver flags */
+  hopfield_set_incremental (h, (input_parameters.solver & SOLVER_INCREMENTAL) != 0);
+  if (input_parameters.legacy_order) {
+    hopfield_set_column_order (h, TRUE);
+    hopfield_set_threads (h, 1);
+    hopfield_set_active (h, FALSE);
+  } else {
+    hopfield_set_column_order (h, FALSE);
+    hopfield_set_threads (h, g_get_num_processors ());
+    hopfield_set_active (h, TRUE);
+  }
+  hopfield_set_synchronous (h, (input_parameters.solver & SOLVER_SYNCHRONOUS) != 0);
+  hopfield_set_damping (h, input_parameters.damping);
+  hopfield_set_quantized (h, (input_parameters.solver & SOLVER_QUANTIZED) != 0);
+  hopfield_set_fixed_point (h, (input_parameters.solver & SOLVER_FIXED_POINT) != 0);
+}
+
+/* The weights depend on the blur mask only. They are calculated once for
+ * all channels and kept from one run to the next while the blur stays. */
+static weights_t* weights_update (void) {
+  if (hopfield.weights.refs &&
+      hopfield.weights_radius == input_parameters.radius &&
+      hopfield.weights_gauss == input_parameters.gauss &&
+      hopfield.weights_motion == input_parameters.motion &&
+      hopfield.weights_mot_angle == input_parameters.mot_angle)
+    return &hopfield.weights;
+  weights_destroy (&hopfield.weights);
+  if (weights_create (&hopfield.weights, &hopfield.blur) == NULL)
+    return NULL;
+  hopfield.weights_radius = input_parameters.radius;
+  hopfield.weights_gauss = input_parameters.gauss;
+  hopfield.weights_motion = input_parameters.motion;
+  hopfield.weights_mot_angle = input_parameters.mot_angle;
+  return &hopfield.weights;
+}
+
 static int compute (int iterations) {
-  int i;
+  int i, refresh, fields, level_steps;
   gdouble lambda_min, lambda;
   gfloat step, final;
-  gboolean is_adaptive, is_smooth, is_mirror;
+  gboolean is_adaptive, is_smooth, is_mirror, is_shared;
+  gboolean doneR, doneG, doneB;
   convmask_t defoc, gauss, motion, blur;
+  multigrid_t multigrid;
 
   event_loop ();
 
@@ -1199,18 +1340,25 @@ static int compute (int iterations) {
   is_smooth = (lambda > 1e-8 && lambda_min < LAMBDAMIN_USABLE_MAX);
   is_adaptive = (input_parameters.adaptive_smooth && is_smooth);
   is_mirror = (input_parameters.boundary == BOUNDARY_MIRROR);
+  refresh = MAX (input_parameters.lambda_refresh, 1);
+  /* one lambda field from all channels serves the three of them */
+  is_shared = (image_parameters.rgb && is_smooth &&
+               (input_parameters.lambda_channels == LAMBDA_RGB_LUMINANCE ||
+                input_parameters.lambda_channels == LAMBDA_RGB_MAX));
+  fields = (image_parameters.rgb && !is_shared ? 3 : 1);
+  level_steps = (input_parameters.levels > 0 ? MIN (input_parameters.levels, MULTIGRID_MAX_LEVELS) * input_parameters.level_iter : 0);
 
   /* PROGRESS BAR */
   step = 1.0;
-  final = (gfloat)iterations;
-  if (is_adaptive) {
-    final *= 2;
-  } else if (is_smooth) {
-    final++;
-  }
+  final = (gfloat)(iterations + level_steps);
   if (image_parameters.rgb) {
     final *= 3.0;
   }
+  if (is_adaptive) {
+    final += (gfloat)(fields * ((iterations + refresh - 1) / refresh));
+  } else if (is_smooth) {
+    final += (gfloat)fields;
+  }
 
   progress_bar_init ();
 
@@ -1231,12 +1379,18 @@ static int compute (int iterations) {
   printf("combine blur+motion+guass+defocus using convmask_convolve()");
   convmask_print(&hopfield.blur, "hopfield.blur");
 #endif
+  if (weights_update () == NULL) goto compute_err5;
 
   if (is_smooth) {
     if (blur_create_gauss (&hopfield.filter, 1.0) == NULL) goto compute_err5;
+    /* scratch images of the lambda fields, reused every iteration */
+    arena_create (&hopfield.arena);
     lambda_set_mirror (&hopfield.lambdafldR, is_mirror);
     lambda_set_nl (&hopfield.lambdafldR, TRUE);
     if (lambda_create (&hopfield.lambdafldR, image_parameters.sel_width, image_parameters.sel_height, lambda_min, input_parameters.winsize, &hopfield.filter) == NULL) goto compute_err6;
+    lambda_set_arena (&hopfield.lambdafldR, &hopfield.arena);
+    /* adaptive lambda is recomputed only around the pixels a sweep changed */
+    lambda_set_incremental (&hopfield.lambdafldR, is_adaptive);
 #if defined(NDEBUG)
     x = image_parameters.sel_width;
     y = image_parameters.sel_height;
@@ -1251,20 +1405,26 @@ static int compute (int iterations) {
     }
     convmask_print(&hopfield.filter, "hopfield.filter");
 #endif
-    if (image_parameters.rgb) {
+    if (image_parameters.rgb && !is_shared) {
       lambda_set_mirror (&hopfield.lambdafldG, is_mirror);
       lambda_set_mirror (&hopfield.lambdafldB, is_mirror);
       lambda_set_nl (&hopfield.lambdafldG, TRUE);
       lambda_set_nl (&hopfield.lambdafldB, TRUE);
       if (lambda_create (&hopfield.lambdafldG, image_parameters.sel_width, image_parameters.sel_height, lambda_min, input_parameters.winsize, &hopfield.filter) == NULL) goto compute_err7;
       if (lambda_create (&hopfield.lambdafldB, image_parameters.sel_width, image_parameters.sel_height, lambda_min, input_parameters.winsize, &hopfield.filter) == NULL) goto compute_err8;
+      lambda_set_arena (&hopfield.lambdafldG, &hopfield.arena);
+      lambda_set_arena (&hopfield.lambdafldB, &hopfield.arena);
+      lambda_set_incremental (&hopfield.lambdafldG, is_adaptive);
+      lambda_set_incremental (&hopfield.lambdafldB, is_adaptive);
     }
 #if defined(NDEBUG)
     printf("..did smooth (before !is_adaptive)\n");
 #endif
 
     if (!is_adaptive) {
-      if (lambda_calculate (&hopfield.lambdafldR, &hopfield.imageR) == NULL) goto compute_err9;
+      if (is_shared) {
+        if (lambda_calculate_rgb (&hopfield.lambdafldR, &hopfield.imageR, &hopfield.imageG, &hopfield.imageB, input_parameters.lambda_channels) == NULL) goto compute_err9;
+      } else if (lambda_calculate (&hopfield.lambdafldR, &hopfield.imageR) == NULL) goto compute_err9;
       progress_bar_update(step++ / final);
 #if defined(NDEBUG)
     x = hopfield.lambdafldR.x;
@@ -1277,7 +1437,7 @@ static int compute (int iterations) {
       printf("\n");
     }
 #endif
-      if (image_parameters.rgb) {
+      if (image_parameters.rgb && !is_shared) {
         if (lambda_calculate (&hopfield.lambdafldG, &hopfield.imageG) == NULL) goto compute_err9;
         progress_bar_update (step++ / final);
         if (lambda_calculate (&hopfield.lambdafldB, &hopfield.imageB) == NULL) goto compute_err9;
@@ -1290,7 +1450,7 @@ static int compute (int iterations) {
   }
 
   hopfield.hopfieldR.lambda = lambda;
-  hopfield_set_mirror (&hopfield.hopfieldR, is_mirror);
+  hopfield_setup (&hopfield.hopfieldR, is_mirror);
   if (is_smooth) {
     if (hopfield_create (&hopfield.hopfieldR, &hopfield.blur, &hopfield.imageR, &hopfield.lambdafldR) == NULL) goto compute_err9;
   } else {
@@ -1314,9 +1474,12 @@ static int compute (int iterations) {
   if (image_parameters.rgb) {
     hopfield.hopfieldG.lambda = lambda;
     hopfield.hopfieldB.lambda = lambda;
-    hopfield_set_mirror (&hopfield.hopfieldG, is_mirror);
-    hopfield_set_mirror (&hopfield.hopfieldB, is_mirror);
-    if (is_smooth) {
+    hopfield_setup (&hopfield.hopfieldG, is_mirror);
+    hopfield_setup (&hopfield.hopfieldB, is_mirror);
+    if (is_shared) {
+      if (hopfield_create (&hopfield.hopfieldG, &hopfield.blur, &hopfield.imageG, &hopfield.lambdafldR) == NULL) goto compute_err10;
+      if (hopfield_create (&hopfield.hopfieldB, &hopfield.blur, &hopfield.imageB, &hopfield.lambdafldR) == NULL) goto compute_err11;
+    } else if (is_smooth) {
       if (hopfield_create (&hopfield.hopfieldG, &hopfield.blur, &hopfield.imageG, &hopfield.lambdafldG) == NULL) goto compute_err10;
       if (hopfield_create (&hopfield.hopfieldB, &hopfield.blur, &hopfield.imageB, &hopfield.lambdafldB) == NULL) goto compute_err11;
     } else {
@@ -1324,6 +1487,26 @@ static int compute (int iterations) {
       if (hopfield_create (&hopfield.hopfieldB, &hopfield.blur, &hopfield.imageB, NULL) == NULL) goto compute_err11;
     }
   }
+  if (input_parameters.levels > 0) {
+    multigrid_set_levels (&multigrid, input_parameters.levels, input_parameters.level_iter);
+    /* the energy and time of every level are reported to tune the levels */
+    if (multigrid_solve (&multigrid, &hopfield.hopfieldR, &hopfield.blur) == NULL) goto compute_err12;
+    multigrid_print (&multigrid, "hopfieldR");
+    step += (gfloat)level_steps;
+    progress_bar_update ((step - 1.0) / final);
+    if (image_parameters.rgb) {
+      if (multigrid_solve (&multigrid, &hopfield.hopfieldG, &hopfield.blur) == NULL) goto compute_err12;
+      multigrid_print (&multigrid, "hopfieldG");
+      step += (gfloat)level_steps;
+      progress_bar_update ((step - 1.0) / final);
+      if (multigrid_solve (&multigrid, &hopfield.hopfieldB, &hopfield.blur) == NULL) goto compute_err12;
+      multigrid_print (&multigrid, "hopfieldB");
+      step += (gfloat)level_steps;
+      progress_bar_update ((step - 1.0) / final);
+    }
+    preview_update ();
+  }
+
 #if defined(NDEBUG)
   /* if image uses 0..255 or 0.0..1.0, weights,blur,lamba */
   /* come out to be equal value, others differ by ~16025. */
@@ -1331,26 +1514,42 @@ static int compute (int iterations) {
   printf("..did lambda = %g, now do iterations=%d\n", lambda, iterations);
 #endif
 
+  /* channels stop independently once they reach the tolerance */
+  doneR = FALSE;
+  doneG = doneB = !image_parameters.rgb;
   for (i = 1; i <= iterations; i++) {
-    if (is_adaptive) {
-      if (lambda_calculate (&hopfield.lambdafldR, &hopfield.imageR) == NULL) goto compute_err12;
+    if (is_adaptive && (i - 1) % refresh == 0) {
+      if (is_shared) {
+        /* every channel still running moves the shared field */
+        if (lambda_calculate_rgb (&hopfield.lambdafldR, &hopfield.imageR, &hopfield.imageG, &hopfield.imageB, input_parameters.lambda_channels) == NULL) goto compute_err12;
+        hopfield_invalidate_lambda (&hopfield.hopfieldG);
+        hopfield_invalidate_lambda (&hopfield.hopfieldB);
+      } else if (!doneR && lambda_calculate (&hopfield.lambdafldR, &hopfield.imageR) == NULL) goto compute_err12;
+      /* tiles under moved lambda blocks are swept again, all of them when
+       * the variance range which normalises lambda moved */
+      hopfield_invalidate_lambda (&hopfield.hopfieldR);
 
       progress_bar_update (step++ / final);
       if (dialog_parameters.finish) break;
 
-      if (image_parameters.rgb) {
-        if (lambda_calculate (&hopfield.lambdafldG, &hopfield.imageG) == NULL) goto compute_err12;
+      if (image_parameters.rgb && !is_shared) {
+        if (!doneG && lambda_calculate (&hopfield.lambdafldG, &hopfield.imageG) == NULL) goto compute_err12;
+        hopfield_invalidate_lambda (&hopfield.hopfieldG);
 
         progress_bar_update (step++ / final);
         if (dialog_parameters.finish) break;
 
-        if (lambda_calculate (&hopfield.lambdafldB, &hopfield.imageB) == NULL) goto compute_err12;
+        if (!doneB && lambda_calculate (&hopfield.lambdafldB, &hopfield.imageB) == NULL) goto compute_err12;
+        hopfield_invalidate_lambda (&hopfield.hopfieldB);
 
         progress_bar_update (step++ / final);
         if (dialog_parameters.finish) break;
       }
     }
-    hopfield_iteration (&hopfield.hopfieldR);
+    if (!doneR) {
+      hopfield_iteration (&hopfield.hopfieldR);
+      doneR = hopfield_converged (&hopfield.hopfieldR, input_parameters.tolerance);
+    }
 
 #if defined(_NDEBUG)
   x = hopfield.lambdafldR.x;
@@ -1372,12 +1571,18 @@ static int compute (int iterations) {
     if (dialog_parameters.finish) break;
 
     if (image_parameters.rgb) {
-      hopfield_iteration (&hopfield.hopfieldG);
+      if (!doneG) {
+        hopfield_iteration (&hopfield.hopfieldG);
+        doneG = hopfield_converged (&hopfield.hopfieldG, input_parameters.tolerance);
+      }
 
       progress_bar_update (step++ / final);
       if (dialog_parameters.finish) break;
 
-      hopfield_iteration (&hopfield.hopfieldB);
+      if (!doneB) {
+        hopfield_iteration (&hopfield.hopfieldB);
+        doneB = hopfield_converged (&hopfield.hopfieldB, input_parameters.tolerance);
+      }
 
       progress_bar_update (step++ / final);
       if (dialog_parameters.finish) break;
@@ -1387,6 +1592,12 @@ static int compute (int iterations) {
 
     while (gtk_events_pending ()) gtk_main_iteration_do(TRUE);
     if (dialog_parameters.finish) break;
+    if (doneR && doneG && doneB) {
+#if defined(NDEBUG)
+      printf("converged after %d iterations\n", i);
+#endif
+      break;
+    }
   }
 
   if (image_parameters.rgb) {
@@ -1395,11 +1606,15 @@ static int compute (int iterations) {
   }
   hopfield_destroy (&hopfield.hopfieldR);
   if (is_smooth) {
-    if (image_parameters.rgb) {
+    if (image_parameters.rgb && !is_shared) {
       lambda_destroy (&hopfield.lambdafldB);
       lambda_destroy (&hopfield.lambdafldG);
     }
     lambda_destroy (&hopfield.lambdafldR);
+#if defined(NDEBUG)
+    arena_print (&hopfield.arena, "lambda");
+#endif
+    arena_destroy (&hopfield.arena);
     convmask_destroy (&hopfield.filter);
   }
   convmask_destroy(&hopfield.blur);
@@ -1417,13 +1632,14 @@ compute_err11:
 compute_err10:
   hopfield_destroy (&hopfield.hopfieldR);
 compute_err9:
-  if (!image_parameters.rgb) goto compute_err7;
+  if (!image_parameters.rgb || is_shared) goto compute_err7;
   if (&hopfield.lambdafldB) lambda_destroy (&hopfield.lambdafldB);
 compute_err8:
   if (&hopfield.lambdafldG) lambda_destroy (&hopfield.lambdafldG);
 compute_err7:
   if (&hopfield.lambdafldR) lambda_destroy (&hopfield.lambdafldR);
 compute_err6:
+    arena_destroy (&hopfield.arena);
     convmask_destroy (&hopfield.filter);
 compute_err5:
   convmask_destroy (&hopfield.blur);
@@ -1487,9 +1703,9 @@ run (const gchar *name, gint nparams, const GimpParam *param,
 
   case GIMP_RUN_NONINTERACTIVE:
     /*INIT_I18N();*/
-    if (nparams != 11) status = GIMP_PDB_CALLING_ERROR;
+    if (nparams < 14) status = GIMP_PDB_CALLING_ERROR;
     else {
-      input_parameters_fetch_params (param);
+      input_parameters_fetch_params (nparams, param);
       compute (input_parameters.iterations);
     }
     break;
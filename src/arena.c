@@ -0,0 +1,83 @@
+/*
+ * Scratch memory for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+arena_t* arena_create(arena_t* arena) {
+  int b;
+
+  for (b = 0; b < ARENA_MAX_BLOCKS; b++) {
+    arena->mem[b] = NULL;
+    arena->block[b] = NULL;
+    arena->size[b] = 0;
+  }
+  arena->used = 0;
+  arena->allocs = 0;
+  arena->bytes = 0;
+  return arena;
+}
+
+/* Frees the blocks and leaves an empty arena, destroying it twice is fine. */
+void arena_destroy(arena_t* arena) {
+  int b;
+
+  for (b = 0; b < ARENA_MAX_BLOCKS; b++) {
+    free(arena->mem[b]);
+    arena->mem[b] = NULL;
+    arena->block[b] = NULL;
+    arena->size[b] = 0;
+  }
+  arena->used = 0;
+}
+
+/* Next block of at least size bytes, aligned to ARENA_ALIGN. The block
+ * in that place is only replaced if it is too small. */
+void* arena_alloc(arena_t* arena, size_t size) {
+  int b;
+  void* mem;
+
+  if (arena->used >= ARENA_MAX_BLOCKS)
+    return NULL;
+  b = arena->used;
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (arena->size[b] < size) {
+    if (!(mem = malloc(size + ARENA_ALIGN)))
+      return NULL;
+    free(arena->mem[b]);
+    arena->bytes += size - arena->size[b];
+    arena->mem[b] = mem;
+    arena->block[b] = (char*)mem + (ARENA_ALIGN - (size_t)mem % ARENA_ALIGN) % ARENA_ALIGN;
+    arena->size[b] = size;
+    arena->allocs++;
+  }
+  arena->used++;
+  return arena->block[b];
+}
+
+int arena_mark(arena_t* arena) {
+  return arena->used;
+}
+
+void arena_release(arena_t* arena, int mark) {
+  arena->used = mark;
+}
+
+#if defined(NDEBUG)
+void arena_print(arena_t* arena, char* str) {
+  printf("ARENA=%s: allocations=%lu bytes=%lu\n", str, arena->allocs, (unsigned long)arena->bytes);
+}
+#endif
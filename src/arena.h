@@ -0,0 +1,54 @@
+/*
+ * Scratch memory for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+#define ARENA_MAX_BLOCKS 16
+#define ARENA_ALIGN      64 /* bytes */
+
+/* Scratch planes handed out as a stack: arena_mark() before taking them,
+ * arena_release() gives back everything taken since. Released blocks are
+ * kept and handed out again in the same order, so a computation repeated
+ * with the same sizes allocates on its first run only. allocs counts the
+ * heap allocations over the life of the arena. */
+typedef struct {
+  void          *mem[ARENA_MAX_BLOCKS];
+  char          *block[ARENA_MAX_BLOCKS];
+  size_t         size[ARENA_MAX_BLOCKS];
+  int            used;
+  unsigned long  allocs;
+  size_t         bytes;
+} arena_t;
+
+arena_t* arena_create(arena_t* arena);
+void arena_destroy(arena_t* arena);
+void* arena_alloc(arena_t* arena, size_t size);
+int arena_mark(arena_t* arena);
+void arena_release(arena_t* arena, int mark);
+
+#if defined(NDEBUG)
+void arena_print(arena_t* arena, char* str);
+#endif
+
+C_DECL_END
+
+#endif
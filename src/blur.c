@@ -117,10 +117,10 @@ convmask_t* blur_create_defocus(convmask_t* blur, double radius) {
   }
 }
 
-/* Create the convolution mask for gaussian blur. */
+/* Create the convolution mask for gaussian blur, it is separable. */
 convmask_t* blur_create_gauss(convmask_t* blur, double variance) {
   double epsilon;
-  double mult;
+  double sum;
   double var;
   int i, j, radius;
 
@@ -137,14 +137,25 @@ convmask_t* blur_create_gauss(convmask_t* blur, double variance) {
     radius = (int)(var * epsilon + 0.5);
     if (!(convmask_create(blur, radius)))
       return NULL;
+    if (!(blur->sep = (double*)malloc(sizeof(double) * blur->r21))) {
+      convmask_destroy(blur);
+      return NULL;
+    }
     var *= var * 2.0;
-    mult = var * M_PI;
-    for (i = 0; i <= radius; i++) {
-      for (j = 0; j <= radius; j++) {
-        convmask_set_circle(blur, i, j, (double)(exp(-((double)(i*i + j*j)) / var) / mult));
+    sum = 0.0;
+    for (i = -radius; i <= radius; i++) {
+      blur->sep[radius + i] = exp(-((double)(i*i)) / var);
+      sum += blur->sep[radius + i];
+    }
+    for (i = 0; i < blur->r21; i++) {
+      blur->sep[i] /= sum;
+    }
+    for (i = -radius; i <= radius; i++) {
+      for (j = -radius; j <= radius; j++) {
+        convmask_set(blur, i, j, blur->sep[radius + i] * blur->sep[radius + j]);
       }
     }
-    return convmask_normalize(blur);
+    return blur;
   }
 }
 
@@ -19,10 +19,21 @@
 
 #include "boundary.h"
 
+/* Whole-sample symmetric reflection about the first and the last sample,
+ * folded as often as needed when x lies more than one image width out. */
 int boundary_normalize_mirror(int x, int lx) {
-  return ((x >= lx) ? 2*lx-x-2 : ((x < 0) ? -x : x));
+  int period;
+
+  if (x >= 0 && x < lx) return x;
+  if (lx <= 1) return 0;
+  period = 2 * (lx - 1);
+  x %= period;
+  if (x < 0) x += period;
+  return ((x >= lx) ? period - x : x);
 }
 
 int boundary_normalize_period(int x, int lx) {
-  return ((x >= lx) ? (x - lx) : ((x < 0) ? x + lx : x));
+  if (x >= 0 && x < lx) return x;
+  x %= lx;
+  return ((x < 0) ? x + lx : x);
 }
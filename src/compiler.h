@@ -41,6 +41,21 @@
 #define C_DECL_END
 #endif
 
+/* Storage of the full image buffers: image planes, thresholds, lambda
+ * fields and weights. configure --enable-float halves their memory and
+ * bandwidth, sums are still accumulated in double. */
+#ifdef USE_FLOAT
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static
+#endif
+
 #ifdef USE_BACKSLASH
 #define OS_SLASH '\\'
 #else
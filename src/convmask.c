@@ -16,6 +16,7 @@
  */
 
 #include "convmask.h"
+#include "fft.h"
 
 static double convmask_get_0(convmask_t* convmask, int i, int j) {
   return ((abs(i) <= convmask->radius && abs(j) <= convmask->radius) ? convmask_get(convmask, i, j) : 0.0);
@@ -27,6 +28,7 @@ convmask_t* convmask_create(convmask_t* convmask, int radius) {
   radius += 1;
   convmask->r21 = radius;
   convmask->speeder = convmask->radius * (convmask->r21 + 1);
+  convmask->sep = NULL;
   if ((convmask->coef = malloc(sizeof(double) * radius * radius)))
     return convmask;
   /* out of memory, returm NULL */
@@ -36,50 +38,116 @@ convmask_t* convmask_create(convmask_t* convmask, int radius) {
   return NULL;
 }
 
+/* Both masks are wrapped onto an n x n plane, n at least r21 of the
+ * result, so the cyclic convolution of the transforms does not alias. */
+static convmask_t* convmask_convolve_fft(convmask_t* ct, convmask_t* c1, convmask_t* c2) {
+  fft_t fft;
+  double *z1, *z2, re;
+  int n, x, y, k;
+
+  n = fft_size(ct->r21);
+  if (!(fft_create(&fft, n)))
+    return NULL;
+  z1 = fft_plane(&fft);
+  z2 = fft_plane(&fft);
+  if (!(z1 && z2)) {
+    free(z1);
+    free(z2);
+    fft_destroy(&fft);
+    return NULL;
+  }
+  for (y = -c1->radius; y <= c1->radius; y++) {
+    for (x = -c1->radius; x <= c1->radius; x++) {
+      z1[2 * (((y + n) % n) * n + (x + n) % n)] = convmask_get(c1, x, y);
+    }
+  }
+  for (y = -c2->radius; y <= c2->radius; y++) {
+    for (x = -c2->radius; x <= c2->radius; x++) {
+      z2[2 * (((y + n) % n) * n + (x + n) % n)] = convmask_get(c2, x, y);
+    }
+  }
+  fft_2d(&fft, z1, 0);
+  fft_2d(&fft, z2, 0);
+  for (k = 0; k < n * n; k++) {
+    re = z1[2 * k] * z2[2 * k] - z1[2 * k + 1] * z2[2 * k + 1];
+    z1[2 * k + 1] = z1[2 * k] * z2[2 * k + 1] + z1[2 * k + 1] * z2[2 * k];
+    z1[2 * k] = re;
+  }
+  fft_2d(&fft, z1, 1);
+  for (y = -ct->radius; y <= ct->radius; y++) {
+    for (x = -ct->radius; x <= ct->radius; x++) {
+      convmask_set(ct, x, y, z1[2 * (((y + n) % n) * n + (x + n) % n)]);
+    }
+  }
+  free(z1);
+  free(z2);
+  fft_destroy(&fft);
+  return ct;
+}
+
+/* c1 is read as zero outside its radius, no padded copy is needed. Large
+ * masks go through the FFT when its three transforms cost less than the
+ * direct sums, the results agree to about 1e-16 of the mask sum. */
 convmask_t* convmask_convolve(convmask_t* ct, convmask_t* c1, convmask_t* c2) {
   int x, y, r, r2, x0, y0;
   double sum;
-  convmask_t ctmp;
 
   if (!(convmask_create(ct, c1->radius + c2->radius)))
     return NULL;
-  if (!(convmask_create(&ctmp, c1->radius + c2->radius))) {
+
+  r = ct->radius;
+  r2 = c2->radius;
+  if (3.0 * fft_cost(fft_size(ct->r21)) < (double)ct->r21 * ct->r21 * c2->r21 * c2->r21) {
+    if (convmask_convolve_fft(ct, c1, c2))
+      return ct;
     convmask_destroy(ct);
     return NULL;
-  };
-
-  r = ctmp.r21 * ctmp.r21;
-  for (x = 0; x < r; x++) {
-    ctmp.coef[x] = 0.0;
   }
-
-  r = c1->radius;
-  for (x = -r; x <= r; x++) {
-    for (y = -r; y <= r; y++) {
-      convmask_set(&ctmp, x, y, convmask_get(c1, x, y));
-    }
-  }
-
-  r = ctmp.radius;
-  r2 = c2->radius;
   for (x = -r; x <= r; x++) {
     for (y = -r; y <= r; y++) {
       sum = 0.0;
       for (x0 = -r2; x0 <= r2; x0++) {
         for (y0 = -r2; y0 <= r2; y0++) {
-          sum += convmask_get_0(&ctmp, x - x0, y - y0) * convmask_get(c2, x0, y0);
+          sum += convmask_get_0(c1, x - x0, y - y0) * convmask_get(c2, x0, y0);
         }
       }
       convmask_set(ct, x, y, sum);
     }
   }
-  convmask_destroy(&ctmp);
 
   return ct;
 }
 
+/* Blur mask for an image halved in size: every coefficient is binned
+ * with a (1/2,1,1/2) tent, so the mask stays centred and symmetric. */
+convmask_t* convmask_downsample(convmask_t* dst, convmask_t* src) {
+  int u, v, p, q, r;
+  double sum, tp;
+
+  r = src->radius;
+  if (!(convmask_create(dst, (r + 1) / 2)))
+    return NULL;
+
+  for (u = -dst->radius; u <= dst->radius; u++) {
+    for (v = -dst->radius; v <= dst->radius; v++) {
+      sum = 0.0;
+      for (p = 2*u - 1; p <= 2*u + 1; p++) {
+        if (abs(p) > r) continue;
+        tp = (p == 2*u) ? 1.0 : 0.5;
+        for (q = 2*v - 1; q <= 2*v + 1; q++) {
+          if (abs(q) > r) continue;
+          sum += tp * ((q == 2*v) ? 1.0 : 0.5) * convmask_get(src, p, q);
+        }
+      }
+      convmask_set(dst, u, v, sum);
+    }
+  }
+  return convmask_normalize(dst);
+}
+
 void convmask_destroy(convmask_t* convmask) {
   free(convmask->coef);
+  free(convmask->sep);
 }
 
 void convmask_set_circle(convmask_t* convmask, int i, int j, double value) {
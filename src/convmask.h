@@ -24,17 +24,21 @@ C_DECL_BEGIN
 
 /** structures */
 
+/* sep, if not NULL, factors the mask: coef(i,j) = sep[r+i] * sep[r+j].
+ * convmask_set() does not keep it in step. */
 typedef struct {
   int     radius;
   int     r21;
   int     speeder;
   double *coef;
+  double *sep;
 } convmask_t;
 
 convmask_t* convmask_create(convmask_t* convmask, int radius);
 void convmask_destroy(convmask_t* convmask);
 convmask_t* convmask_normalize(convmask_t* convmask);
 convmask_t* convmask_convolve(convmask_t* ct, convmask_t* c1, convmask_t* c2);
+convmask_t* convmask_downsample(convmask_t* dst, convmask_t* src);
 void convmask_set(convmask_t* convmask, int i, int j, double value);
 double convmask_get(convmask_t* convmask, int i, int j);
 void convmask_set_circle(convmask_t* convmask, int i, int j, double value);
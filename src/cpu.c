@@ -0,0 +1,60 @@
+/*
+ * Run time instruction set selection for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "cpu.h"
+
+static const char* cpu_isa_names[CPU_ISA_LAST] = { "generic", "avx2", "avx512" };
+static int cpu_isa_selected = -1;
+
+static int cpu_isa_detect(void) {
+#if CPU_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return CPU_ISA_AVX512;
+  if (__builtin_cpu_supports("avx2")) return CPU_ISA_AVX2;
+#endif
+  return CPU_ISA_GENERIC;
+}
+
+/* Widest instruction set of the host, detected on the first call. The
+ * environment may ask for a narrower one, never for one the CPU lacks.
+ * The first call must not race with others, hopfield_create() makes it
+ * before any parallel sweep. */
+int cpu_isa(void) {
+  const char* env;
+  int isa, best, i;
+
+  if (cpu_isa_selected >= 0)
+    return cpu_isa_selected;
+
+  isa = best = cpu_isa_detect();
+  if ((env = getenv(CPU_ISA_ENV))) {
+    for (i = 0; i < CPU_ISA_LAST; i++) {
+      if (!strcmp(env, cpu_isa_names[i])) isa = i;
+    }
+    if (isa > best) isa = best;
+  }
+#if defined(NDEBUG)
+  printf("cpu_isa(), detected %s, using %s\n", cpu_isa_names[best], cpu_isa_names[isa]);
+#endif
+  cpu_isa_selected = isa;
+  return isa;
+}
+
+const char* cpu_isa_name(int isa) {
+  return ((isa >= 0 && isa < CPU_ISA_LAST) ? cpu_isa_names[isa] : "unknown");
+}
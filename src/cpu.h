@@ -0,0 +1,56 @@
+/*
+ * Run time instruction set selection for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CPU_H
+#define _CPU_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+#define CPU_ISA_GENERIC 0
+#define CPU_ISA_AVX2    1
+#define CPU_ISA_AVX512  2
+#define CPU_ISA_LAST    3
+
+/* Environment variable forcing an instruction set: generic, avx2, avx512 */
+#define CPU_ISA_ENV "REFOCUS_IT_ISA"
+
+/* Hot kernels are compiled once per instruction set by wrapping always
+ * inline bodies in functions with these targets. AVX-512 brings FMA along,
+ * contraction is switched off so that every flavour rounds the same way
+ * and the results do not depend on the host. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#define CPU_DISPATCH 1
+#define CPU_TARGET_AVX2   __attribute__((target("avx2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#else
+#define CPU_DISPATCH 0
+#define CPU_TARGET_AVX2
+#define CPU_TARGET_AVX512
+#endif
+
+/* The flavour name##_generic, name##_avx2 or name##_avx512 to run */
+#define CPU_SELECT(name) \
+  (cpu_isa() == CPU_ISA_AVX512 ? name##_avx512 : (cpu_isa() == CPU_ISA_AVX2 ? name##_avx2 : name##_generic))
+
+int cpu_isa(void);
+const char* cpu_isa_name(int isa);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Fast Fourier transform for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fft.h"
+
+/* Smallest power of two not below n. */
+int fft_size(int n) {
+  int size;
+
+  for (size = 1; size < n; size *= 2) {
+  }
+  return size;
+}
+
+fft_t* fft_create(fft_t* fft, int n) {
+  int i, j, k, h;
+
+  fft->n = n;
+  h = (n > 1 ? n / 2 : 1);
+  fft->rev = (int*)malloc(sizeof(int) * n);
+  fft->cs = (double*)malloc(sizeof(double) * 2 * h);
+  fft->col = (double*)malloc(sizeof(double) * 2 * n);
+  if (!(fft->rev && fft->cs && fft->col)) {
+#if defined(NDEBUG)
+    printf("Error, fft_create() - Out of memory!\n");
+#endif
+    fft_destroy(fft);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    for (j = 0, k = 1; k < n; k *= 2) {
+      j = 2 * j + ((i & k) ? 1 : 0);
+    }
+    fft->rev[i] = j;
+  }
+  for (i = 0; i < h; i++) {
+    fft->cs[2 * i] = cos(2.0 * M_PI * i / n);
+    fft->cs[2 * i + 1] = sin(2.0 * M_PI * i / n);
+  }
+  return fft;
+}
+
+void fft_destroy(fft_t* fft) {
+  free(fft->rev);
+  free(fft->cs);
+  free(fft->col);
+  fft->rev = NULL;
+  fft->cs = NULL;
+  fft->col = NULL;
+}
+
+/* Zeroed n x n complex plane, to be freed by the caller. */
+double* fft_plane(fft_t* fft) {
+  return (double*)calloc((size_t)2 * fft->n * fft->n, sizeof(double));
+}
+
+/* In place transform of n complex values, e^(-i...) forward and e^(+i...)
+ * inverse, unscaled. */
+static void fft_line(fft_t* fft, double* z) {
+  int n, i, j, k, h, step;
+  double t, tr, ti, wr, wi, *a, *b;
+
+  n = fft->n;
+  for (i = 0; i < n; i++) {
+    j = fft->rev[i];
+    if (j > i) {
+      t = z[2 * i]; z[2 * i] = z[2 * j]; z[2 * j] = t;
+      t = z[2 * i + 1]; z[2 * i + 1] = z[2 * j + 1]; z[2 * j + 1] = t;
+    }
+  }
+  for (h = 1; h < n; h *= 2) {
+    step = n / (2 * h);
+    for (k = 0; k < n; k += 2 * h) {
+      for (j = 0; j < h; j++) {
+        wr = fft->cs[2 * j * step];
+        wi = -fft->cs[2 * j * step + 1];
+        a = z + 2 * (k + j);
+        b = a + 2 * h;
+        tr = wr * b[0] - wi * b[1];
+        ti = wr * b[1] + wi * b[0];
+        b[0] = a[0] - tr;
+        b[1] = a[1] - ti;
+        a[0] += tr;
+        a[1] += ti;
+      }
+    }
+  }
+}
+
+/* Rows, then columns gathered one at a time. The inverse is the forward
+ * transform of the conjugate, conjugated and scaled by 1/n^2. */
+void fft_2d(fft_t* fft, double* z, int inverse) {
+  int n, i, j;
+  double scale;
+
+  n = fft->n;
+  if (inverse) {
+    for (i = 0; i < n * n; i++) {
+      z[2 * i + 1] = -z[2 * i + 1];
+    }
+  }
+  for (j = 0; j < n; j++) {
+    fft_line(fft, z + 2 * n * j);
+  }
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++) {
+      fft->col[2 * j] = z[2 * (n * j + i)];
+      fft->col[2 * j + 1] = z[2 * (n * j + i) + 1];
+    }
+    fft_line(fft, fft->col);
+    for (j = 0; j < n; j++) {
+      z[2 * (n * j + i)] = fft->col[2 * j];
+      z[2 * (n * j + i) + 1] = fft->col[2 * j + 1];
+    }
+  }
+  if (inverse) {
+    scale = 1.0 / ((double)n * n);
+    for (i = 0; i < n * n; i++) {
+      z[2 * i] *= scale;
+      z[2 * i + 1] *= -scale;
+    }
+  }
+}
+
+/* Multiply-adds of one fft_2d() of an n x n plane, in the units of the
+ * direct loops it replaces: a butterfly is a complex multiply-add. */
+double fft_cost(int n) {
+  int k;
+
+  for (k = 0; (1 << k) < n; k++) {
+  }
+  return 4.0 * n * n * (k > 0 ? k : 1);
+}
@@ -0,0 +1,45 @@
+/*
+ * Fast Fourier transform for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FFT_H
+#define _FFT_H
+
+#include "compiler.h"
+
+C_DECL_BEGIN
+
+/* Radix-2 transforms of n x n complex planes, stored row by row with
+ * the real and imaginary parts interleaved. The twiddles are cos and sin
+ * of 2*pi*k/n, each calculated on its own, so the error does not grow
+ * with n the way a recurrence would. */
+typedef struct {
+  int     n;
+  int    *rev;
+  double *cs;
+  double *col;
+} fft_t;
+
+int fft_size(int n);
+fft_t* fft_create(fft_t* fft, int n);
+void fft_destroy(fft_t* fft);
+double* fft_plane(fft_t* fft);
+void fft_2d(fft_t* fft, double* z, int inverse);
+double fft_cost(int n);
+
+C_DECL_END
+
+#endif
@@ -16,7 +16,14 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+#include <stdint.h>
 #include "hopfield.h"
+#include "cpu.h"
+#include "simd.h"
+
+#define HOPFIELD_TILE_SIZE 64
+#define HOPFIELD_KERNEL_R   8  /* largest tap radius with its own kernel */
 
 #define hardlim(x) ((x)>=0.0?1.0:-1.0)
 #ifndef min
@@ -28,250 +35,335 @@
 
 /* Private functions */
 
-static double hopfield_iteration_period(hopfield_t* hopfield) {
-  double pom;
-  int p, r;
-  int i,j;
-  double s;
-  int k;
+/* Counter based random numbers: a hash of the seed, the iteration, the
+ * pixel and the draw number, so the steps do not depend on the order in
+ * which pixels are visited or on the number of threads. */
+ALWAYS_INLINE unsigned int hopfield_random(hopfield_t* hopfield, int i, int j, int draw) {
+  uint64_t z;
+
+  z = ((uint64_t)hopfield->seed << 32) | hopfield->iteration;
+  z += 0x9e3779b97f4a7c15ULL * (((uint64_t)j * hopfield->image->x + i) * 2 + draw + 1);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= (z >> 31);
+  return (unsigned int)(z >> 32);
+}
+
+/* Incremental engine: field[] holds the weight correlation of every pixel
+ * and is updated only around pixels which change, so the cost of a sweep
+ * scales with the number of changed pixels instead of pixels x taps. */
+
+/* Pixel at offset o from the centre of a smoothing stencil */
+#define HOPFIELD_C(o) (quant ? image_levels[c8[o]] : c[o])
+
+ALWAYS_INLINE double hopfield_smooth(image_halo_t* image, int i, int j, int quant) {
+  real_t *c;
+  unsigned char *c8;
+  int st;
+  double z;
+
+  c = (quant ? NULL : &image_halo_get(image, i, j));
+  c8 = (quant ? &image_halo_get8(image, i, j) : NULL);
+  st = image->stride;
+  z = 20.0 * HOPFIELD_C(0);
+  z += HOPFIELD_C(2);
+  z += HOPFIELD_C(-2);
+  z += 2.0 * (HOPFIELD_C(1 - st) +
+              HOPFIELD_C(-1 + st) +
+              HOPFIELD_C(1 + st) +
+              HOPFIELD_C(-1 - st));
+  z += HOPFIELD_C(2 * st);
+  z += HOPFIELD_C(-2 * st);
+  z += -8.0 * (HOPFIELD_C(1) +
+               HOPFIELD_C(st) +
+               HOPFIELD_C(-1) +
+               HOPFIELD_C(-st));
+  return z;
+}
+
+ALWAYS_INLINE double hopfield_smooth_lambda(hopfield_t* hopfield, image_halo_t* image,
+                                            double (*lget)(lambda_t*, int, int), int i, int j, int quant, double* ppom) {
+  double lmbd00, lmbd01, lmbd10, lmbd_10, lmbd0_1;
+  double pom, z;
+  real_t *c;
+  unsigned char *c8;
+  int st;
+
+  lmbd00  = lget(hopfield->lambdafld, i  , j  );
+  lmbd01  = lget(hopfield->lambdafld, i  , j+1);
+  lmbd10  = lget(hopfield->lambdafld, i+1, j  );
+  lmbd_10 = lget(hopfield->lambdafld, i-1, j  );
+  lmbd0_1 = lget(hopfield->lambdafld, i  , j-1);
+
+  c = (quant ? NULL : &image_halo_get(image, i, j));
+  c8 = (quant ? &image_halo_get8(image, i, j) : NULL);
+  st = image->stride;
+  pom = (lmbd01 + lmbd10 + lmbd_10 + lmbd0_1 + 16.0 * lmbd00);
+  z = pom * HOPFIELD_C(0);
+  z += lmbd10 * HOPFIELD_C(2);
+  z += lmbd_10 * HOPFIELD_C(-2);
+  z += (lmbd10 + lmbd0_1) * HOPFIELD_C(1 - st);
+  z += (lmbd01 + lmbd_10) * HOPFIELD_C(-1 + st);
+  z += (lmbd10 + lmbd01) * HOPFIELD_C(1 + st);
+  z += (lmbd0_1 + lmbd_10) * HOPFIELD_C(-1 - st);
+  z += -4.0 * (lmbd10 + lmbd00) * HOPFIELD_C(1);
+  z += -4.0 * (lmbd00 + lmbd_10) * HOPFIELD_C(-1);
+  z += lmbd01 * HOPFIELD_C(2 * st);
+  z += lmbd0_1 * HOPFIELD_C(-2 * st);
+  z += -4.0 * (lmbd01 + lmbd00) * HOPFIELD_C(st);
+  z += -4.0 * (lmbd00 + lmbd0_1) * HOPFIELD_C(-st);
+
+  *ppom = pom;
+  return z;
+}
+
+#undef HOPFIELD_C
+
+/* Hopfield update rule for pixel (i,j) with local field s and self
+ * coupling pom. Returns the change of the pixel value (0.0 if none).
+ * The step is decided without branches: the random draw only depends on
+ * the pixel and the iteration, so it is taken whether used or not. */
+ALWAYS_INLINE double hopfield_update(hopfield_t* hopfield, int i, int j, double s, double pom, double* Sum) {
+  int k, kmax, up;
   int value8;
-  double dE;
-  double Sum;
-  double ddui;
   double dk;
-  double z;
-  int x, y;
   double value;
-  int rxnz, rynz;
+  unsigned int rnd;
+
+  value = image_get(hopfield->image, i, j);
+  value8 = (int)(255.0 * value + 0.5);
+  k = (s >= 0.0 ? 1 : -1) - (int)(s/pom);
+  up = (k > 0);
+  /* room left in the direction of k, none unless the energy drops */
+  kmax = min(up ? k : -k, up ? 255 - value8 : value8);
+  kmax &= -(int)(-2.0 * hardlim(s) * s - pom < 0.0);
+  rnd = hopfield_random(hopfield, i, j, 0);
+  k = (int)(rnd % (unsigned int)(kmax + (kmax == 0))) + 1;
+  k = (up ? k : -k) & -(int)(kmax > 0);
+  if (hopfield->synchronous) {
+    /* all pixels move at once, damp the steps to keep descending;
+     * stochastic rounding keeps the expected step at damping*k */
+    dk = hopfield->step * k + (hopfield_random(hopfield, i, j, 1) % 1024) / 1024.0;
+    k = (int)floor(dk) & -(int)(k != 0);
+  }
+  if (k == 0)
+    return 0.0;
+
+  value8 += k;
+  dk = k;
+  *Sum += (-2.0*s - pom*dk)*dk;
+  image_set(hopfield->image, i, j, (value8/255.0));
+  image_halo_set(&(hopfield->state), i, j, (value8/255.0));
+  return (value8/255.0) - value;
+}
+
+/* Coordinates in -r..l-1+r which the boundary conditions map onto a. */
+ALWAYS_INLINE int hopfield_preimages(int a, int l, int r, int mirror, int* u) {
+  int n;
+
+  n = 0;
+  u[n++] = a;
+  if (mirror) {
+    if (a > 0 && -a >= -r) u[n++] = -a;
+    if (a < l - 1 && 2*l - 2 - a <= l - 1 + r) u[n++] = 2*l - 2 - a;
+  } else {
+    if (a - l >= -r) u[n++] = a - l;
+    if (a + l <= l - 1 + r) u[n++] = a + l;
+  }
+  return n;
+}
+
+/* Pixel (a,b) changed by dv, add dv*w(p,r) to every field that taps it. */
+ALWAYS_INLINE void hopfield_field_push(hopfield_t* hopfield, int a, int b, double dv) {
+  int ux[3], uy[3];
+  int nx, ny, m, n;
+  int r, p0, p1, r0, r1;
+  int x, y, rxnz, rynz, wsize;
+  double *row;
+  real_t *w0;
 
   x = hopfield->image->x;
   y = hopfield->image->y;
   rxnz = hopfield->weights.rxnz;
   rynz = hopfield->weights.rynz;
-
-  pom = weights_get(&(hopfield->weights), 0, 0) - 20.0 * hopfield->lambda;
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_period(hopfield->image, i+p, j+r);
-        }
-      }
-
-      z = 20.0 * image_get_period(hopfield->image, i,j);
-      z += image_get_period(hopfield->image, i+2, j);
-      z += image_get_period(hopfield->image, i-2, j);
-      z += 2.0 * (image_get_period(hopfield->image, i+1, j-1) +
-                  image_get_period(hopfield->image, i-1, j+1) +
-                  image_get_period(hopfield->image, i+1, j+1) +
-                  image_get_period(hopfield->image, i-1, j-1));
-      z += image_get_period(hopfield->image, i, j+2);
-      z += image_get_period(hopfield->image, i, j-2);
-      z += -8.0 * (image_get_period(hopfield->image, i+1, j  ) +
-                   image_get_period(hopfield->image, i  , j+1) +
-                   image_get_period(hopfield->image, i-1, j  ) +
-                   image_get_period(hopfield->image, i  , j-1));
-
-      s -= hopfield->lambda*z;
-      s += threshold_get(&(hopfield->threshold), i, j);
-      s *= 255.0; /* adjust image from 0.0..1.0 to 0.0..255.0 */
-
-      ddui = hardlim(s);
-      dE = -2.0 * s * ddui - pom;
-      if (dE < 0.0) {
-        value = image_get(hopfield->image, i, j);
-        value8 = (int)(255.0 * value + 0.5);
-        k = (s >= 0.0 ? 1 :-1);
-        k -= (int)(s/pom);
-        if (k > 0 && value8 < 255) {
-          k = min(k, 255 - value8);
-          k = (rand()%k) + 1;
-          value8 += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        } else if (k < 0 && value8 > 0) {
-          k = min(-k, value8);
-          k = (rand()%k) + 1;
-          value8 -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        }
+  wsize = hopfield->weights.size;
+  w0 = hopfield->weights.w + hopfield->weights.r2 * wsize + hopfield->weights.r2;
+
+  nx = hopfield_preimages(a, x, rxnz, hopfield->mirror, ux);
+  ny = hopfield_preimages(b, y, rynz, hopfield->mirror, uy);
+  for (n = 0; n < ny; n++) {
+    r0 = max(-rynz, uy[n] - (y - 1));
+    r1 = min(rynz, uy[n]);
+    for (m = 0; m < nx; m++) {
+      p0 = max(-rxnz, ux[m] - (x - 1));
+      p1 = min(rxnz, ux[m]);
+      /* row[-p] += dv*w(p,r) for p = p0..p1, run forwards using the
+       * point symmetry w(p,r) = w(-p,-r) of the weights */
+      for (r = r0; r <= r1; r++) {
+        row = hopfield->field + (uy[n] - r) * x + ux[m];
+        simd_axpy(row - p1, w0 - r * wsize - p1, dv, p1 - p0 + 1);
       }
     }
   }
-  return Sum;
 }
 
-static double hopfield_iteration_period_lambda(hopfield_t* hopfield) {
-  int p, r;
-  int i, j;
-  int k;
-  int value8;
-  double dE;
-  double Sum;
-  double ddui;
-  double dk;
-  double z;
-  double value;
-  double pom;
-  double lmbd00, lmbd01, lmbd10, lmbd_10, lmbd0_1;
+/* Weight correlation at (i,j), the halo makes every tap row a plain
+ * strided load. */
+ALWAYS_INLINE double hopfield_correlate(hopfield_t* hopfield, image_halo_t* image, int i, int j, int quant, int wide) {
+  int r;
   double s;
-  int x, y;
   int rxnz, rynz;
+  real_t *w, *v;
 
-  x = hopfield->image->x;
-  y = hopfield->image->y;
   rxnz = hopfield->weights.rxnz;
   rynz = hopfield->weights.rynz;
+  s = 0.0;
+  for (r = -rynz; r <= rynz; r++) {
+    w = hopfield->weights.w + (hopfield->weights.r2 + r) * hopfield->weights.size + hopfield->weights.r2;
+    if (quant) {
+      s += simd_dot_levels(w - rxnz, &image_halo_get8(image, i - rxnz, j + r), image_levels, 2 * rxnz + 1);
+    } else {
+      v = &image_halo_get(image, i, j + r);
+      if (wide) s += simd_dot_wide(w - rxnz, v - rxnz, 2 * rxnz + 1);
+      else s += simd_dot(w - rxnz, v - rxnz, 2 * rxnz + 1);
+    }
+  }
+  return s;
+}
 
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_period(hopfield->image, i+p, j+r);
-        }
-      }
+ALWAYS_INLINE void hopfield_field_init_body(hopfield_t* hopfield, int wide) {
+  int quant;
+  int i, j;
+  int x, y;
 
-      lmbd00  = lambda_get_period(hopfield->lambdafld, i  , j  );
-      lmbd01  = lambda_get_period(hopfield->lambdafld, i  , j+1);
-      lmbd10  = lambda_get_period(hopfield->lambdafld, i+1, j  );
-      lmbd_10 = lambda_get_period(hopfield->lambdafld, i-1, j  );
-      lmbd0_1 = lambda_get_period(hopfield->lambdafld, i  , j-1);
-
-      pom = (lmbd01 + lmbd10 + lmbd_10 + lmbd0_1 + 16.0 * lmbd00);
-      z = pom * image_get_period(hopfield->image, i, j);
-      z += lmbd10 * image_get_period(hopfield->image, i+2, j);
-      z += lmbd_10 * image_get_period(hopfield->image, i-2, j);
-      z += (lmbd10 + lmbd0_1) * image_get_period(hopfield->image, i+1, j-1);
-      z += (lmbd01 + lmbd_10) * image_get_period(hopfield->image, i-1, j+1);
-      z += (lmbd10 + lmbd01) * image_get_period(hopfield->image, i+1, j+1);
-      z += (lmbd0_1 + lmbd_10) * image_get_period(hopfield->image, i-1, j-1);
-      z += -4.0 * (lmbd10 + lmbd00) * image_get_period(hopfield->image, i+1, j);
-      z += -4.0 * (lmbd00 + lmbd_10) * image_get_period(hopfield->image, i-1, j);
-      z += lmbd01 * image_get_period(hopfield->image, i, j+2);
-      z += lmbd0_1 * image_get_period(hopfield->image, i, j-2);
-      z += -4.0 * (lmbd01 + lmbd00) * image_get_period(hopfield->image, i, j+1);
-      z += -4.0 * (lmbd00 + lmbd0_1) * image_get_period(hopfield->image, i, j-1);
-
-      s -= hopfield->lambda*z;
-      pom = -pom;
-      pom *= hopfield->lambda;
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  quant = (hopfield->state.data8 != NULL);
 
-      s += threshold_get(&(hopfield->threshold), i, j);
-      s *= 255.0; /* adjust image from 0.0..1.0 to 0.0..255.0 */
-      pom += weights_get(&(hopfield->weights), 0, 0);
-
-      ddui = hardlim(s);
-      dE = -2.0 * s * ddui - pom;
-      if (dE < 0.0) {
-        value = image_get(hopfield->image, i, j);
-        value8 = (int)(255.0 * value + 0.5);
-        k = (s >= 0.0 ? 1 :-1);
-        k -= (int)(s/pom);
-        if (k > 0 && value8 < 255) {
-          k = min(k, 255-value8);
-          k = (rand()%k) + 1;
-          value8 += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        } else if (k < 0 && value8 > 0) {
-          k = min(-k, value8);
-          k = (rand()%k) + 1;
-          value8 -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        }
-      }
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      hopfield->field[j * x + i] = hopfield_correlate(hopfield, &(hopfield->state), i, j, quant, wide);
     }
   }
-  return Sum;
 }
 
-static double hopfield_iteration_mirror(hopfield_t* hopfield) {
-  double pom;
-  int p, r;
-  int i,j;
-  double s;
-  int k;
-  int value8;
-  double dE;
+static void hopfield_field_init_generic(hopfield_t* hopfield) {
+  hopfield_field_init_body(hopfield, 0);
+}
+
+CPU_TARGET_AVX2 static void hopfield_field_init_avx2(hopfield_t* hopfield) {
+  hopfield_field_init_body(hopfield, 0);
+}
+
+CPU_TARGET_AVX512 static void hopfield_field_init_avx512(hopfield_t* hopfield) {
+  hopfield_field_init_body(hopfield, 1);
+}
+
+static void hopfield_field_init(hopfield_t* hopfield) {
+  CPU_SELECT(hopfield_field_init)(hopfield);
+}
+
+/* Sweep the pixels i0..i1-1 x j0..j1-1 evaluating the local fields on
+ * src, which is the state itself for in-place sweeps. Rows are visited in
+ * memory order unless the legacy column order is requested. The body is
+ * instantiated below for every instruction set, lambda mode and tap
+ * radius R: KERNEL_FIELD takes the correlation from field[], KERNEL_ANY
+ * uses the radii of the weights and fixed radii give the compiler
+ * constant trip counts (weights_create() zeroes the taps outside
+ * rxnz/rynz). */
+
+#define HOPFIELD_LAMBDA_NONE     0
+#define HOPFIELD_LAMBDA_CONST    1
+#define HOPFIELD_LAMBDA_ADAPTIVE 2
+
+#define KERNEL_FIELD 0
+#define KERNEL_ANY   (HOPFIELD_KERNEL_R + 1)
+
+ALWAYS_INLINE double hopfield_sweep_body(hopfield_t* hopfield, image_halo_t* src, int i0, int i1, int j0, int j1,
+                                         int* changed, int lambda, double (*lget)(lambda_t*, int, int), int R,
+                                         int quant, int fixed, int wide) {
+  int i, j;
+  int n, m, n1, m1;
+  int r, is;
+  int x, rx, ry, wsize;
+  double s, z, w00, pom, dv, qscale;
+  real_t *w0, *w, *v;
+  short *wq0;
   double Sum;
-  double ddui;
-  double dk;
-  double z;
-  int x, y;
-  double value;
-  int rxnz, rynz;
 
   x = hopfield->image->x;
-  y = hopfield->image->y;
-  rxnz = hopfield->weights.rxnz;
-  rynz = hopfield->weights.rynz;
+  if (R == KERNEL_ANY) {
+    rx = hopfield->weights.rxnz;
+    ry = hopfield->weights.rynz;
+  } else {
+    rx = ry = R;
+  }
+  wsize = hopfield->weights.size;
+  w0 = hopfield->weights.w + hopfield->weights.r2 * wsize + hopfield->weights.r2;
+  wq0 = (fixed ? hopfield->weights.wq + hopfield->weights.rynz * hopfield->weights.qstride : NULL);
+  qscale = hopfield->weights.qscale / 255.0;
 
-  pom = weights_get(&(hopfield->weights), 0, 0) - 20.0 * hopfield->lambda;
+  w00 = weights_get(&(hopfield->weights), 0, 0);
+  pom = w00 - 20.0 * hopfield->lambda;
   Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_mirror(hopfield->image, i+p, j+r);
+  n1 = (hopfield->column_order ? i1 - i0 : j1 - j0);
+  m1 = (hopfield->column_order ? j1 - j0 : i1 - i0);
+  for (n = 0; n < n1; n++) {
+    for (m = 0; m < m1; m++) {
+      if (hopfield->column_order) {
+        i = i0 + n;
+        j = j0 + m;
+      } else {
+        i = i0 + m;
+        j = j0 + n;
+      }
+      if (R == KERNEL_FIELD) {
+        s = hopfield->field[j * x + i];
+      } else if (fixed) {
+        /* the padded rows read up to 31 levels past the taps, at zero
+         * weight and still inside the halo image allocation */
+        is = 0;
+        for (r = -ry; r <= ry; r++) {
+          is += simd_dot_fixed(wq0 + r * hopfield->weights.qstride, &image_halo_get8(src, i - rx, j + r),
+                               hopfield->weights.qstride);
+        }
+        s = is * qscale;
+      } else {
+        s = 0.0;
+        for (r = -ry; r <= ry; r++) {
+          w = w0 + r * wsize;
+          if (quant) {
+            s += simd_dot_levels(w - rx, &image_halo_get8(src, i - rx, j + r), image_levels, 2 * rx + 1);
+          } else {
+            v = &image_halo_get(src, i, j + r);
+            if (wide) s += simd_dot_wide(w - rx, v - rx, 2 * rx + 1);
+            else s += simd_dot(w - rx, v - rx, 2 * rx + 1);
+          }
         }
       }
-
-      z = 20.0 * image_get_mirror(hopfield->image, i,j);
-      z += image_get_mirror(hopfield->image, i+2, j);
-      z += image_get_mirror(hopfield->image, i-2, j);
-      z += 2.0 * (image_get_mirror(hopfield->image, i+1, j-1) +
-                  image_get_mirror(hopfield->image, i-1, j+1) +
-                  image_get_mirror(hopfield->image, i+1, j+1) +
-                  image_get_mirror(hopfield->image, i-1, j-1));
-      z += image_get_mirror(hopfield->image, i, j+2);
-      z += image_get_mirror(hopfield->image, i, j-2);
-      z += -8.0 * (image_get_mirror(hopfield->image, i+1, j  ) +
-                   image_get_mirror(hopfield->image, i  , j+1) +
-                   image_get_mirror(hopfield->image, i-1, j  ) +
-                   image_get_mirror(hopfield->image, i  , j-1));
-
-      s -= hopfield->lambda*z;
+      if (lambda == HOPFIELD_LAMBDA_ADAPTIVE) {
+        z = hopfield_smooth_lambda(hopfield, src, lget, i, j, quant, &pom);
+        s -= hopfield->lambda*z;
+        pom = w00 - hopfield->lambda*pom;
+      } else if (lambda == HOPFIELD_LAMBDA_CONST) {
+        z = hopfield_smooth(src, i, j, quant);
+        s -= hopfield->lambda*z;
+      }
       s += threshold_get(&(hopfield->threshold), i, j);
       s *= 255.0; /* adjust image from 0.0..1.0 to 0.0..255.0 */
 
-      ddui = hardlim(s);
-      dE = -2.0 * s * ddui - pom;
-      if (dE < 0.0) {
-        value = image_get(hopfield->image, i, j);
-        value8 = (int)(255.0 * value + 0.5);
-        k = (s >= 0.0 ? 1 :-1);
-        k -= (int)(s/pom);
-        if (k>0 && value8 < 255) {
-          k = min(k, 255 - value8);
-          k = (rand()%k)+1;
-          value8 += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        } else if (k < 0 && value8 > 0) {
-          k = min(-k, value8);
-          k = (rand()%k)+1;
-          value8 -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
+      dv = hopfield_update(hopfield, i, j, s, pom, &Sum);
+      if (dv != 0.0) {
+        (*changed)++;
+        /* a synchronous field is calculated again for the next sweep */
+        if (R == KERNEL_FIELD && !hopfield->synchronous)
+          hopfield_field_push(hopfield, i, j, dv);
+        if (lambda == HOPFIELD_LAMBDA_ADAPTIVE && hopfield->lambdafld->dirty) {
+          /* neighbouring tiles of a synchronous sweep share blocks */
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+          hopfield->lambdafld->dirty[lambda_block(hopfield->lambdafld, i, j)] = 1;
         }
       }
     }
@@ -279,101 +371,215 @@ static double hopfield_iteration_mirror(hopfield_t* hopfield) {
   return Sum;
 }
 
-static double hopfield_iteration_mirror_lambda(hopfield_t* hopfield) {
-  int p, r;
-  int i, j;
-  int k;
-  int value8;
-  double dE;
-  double Sum;
-  double ddui;
-  double dk;
-  double z;
-  double value;
-  double pom;
-  double lmbd00, lmbd01, lmbd10, lmbd_10, lmbd0_1;
-  double s;
-  int x, y;
-  int rxnz, rynz;
+typedef double (*hopfield_kernel_t)(hopfield_t*, image_halo_t*, int, int, int, int, int*);
 
-  x = hopfield->image->x;
-  y = hopfield->image->y;
-  rxnz = hopfield->weights.rxnz;
-  rynz = hopfield->weights.rynz;
+#define HOPFIELD_KERNEL(name, target, wide, lambda, lget, R, quant, fixed) \
+  target static double name(hopfield_t* hopfield, image_halo_t* src, int i0, int i1, int j0, int j1, int* changed) { \
+    return hopfield_sweep_body(hopfield, src, i0, i1, j0, j1, changed, lambda, lget, R, quant, fixed, wide); \
+  }
 
-  Sum = 0.0;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (p = -rxnz; p <= rxnz; p++) {
-        for (r = -rynz; r <= rynz; r++) {
-          s += weights_get(&(hopfield->weights), p, r) * image_get_mirror(hopfield->image, i+p, j+r);
-        }
+/* The quantized state only gets the field and the generic kernel, the
+ * table maps its fixed radii onto the latter. Fixed point sweeps never
+ * have a field, their field slot only repeats the quantized one. */
+#define HOPFIELD_KERNELS(name, target, wide, lambda, lget) \
+  HOPFIELD_KERNEL(name##_field, target, wide, lambda, lget, KERNEL_FIELD, 0, 0) \
+  HOPFIELD_KERNEL(name##_1, target, wide, lambda, lget, 1, 0, 0) \
+  HOPFIELD_KERNEL(name##_2, target, wide, lambda, lget, 2, 0, 0) \
+  HOPFIELD_KERNEL(name##_3, target, wide, lambda, lget, 3, 0, 0) \
+  HOPFIELD_KERNEL(name##_4, target, wide, lambda, lget, 4, 0, 0) \
+  HOPFIELD_KERNEL(name##_5, target, wide, lambda, lget, 5, 0, 0) \
+  HOPFIELD_KERNEL(name##_6, target, wide, lambda, lget, 6, 0, 0) \
+  HOPFIELD_KERNEL(name##_7, target, wide, lambda, lget, 7, 0, 0) \
+  HOPFIELD_KERNEL(name##_8, target, wide, lambda, lget, 8, 0, 0) \
+  HOPFIELD_KERNEL(name##_any, target, wide, lambda, lget, KERNEL_ANY, 0, 0) \
+  HOPFIELD_KERNEL(name##_q_field, target, wide, lambda, lget, KERNEL_FIELD, 1, 0) \
+  HOPFIELD_KERNEL(name##_q_any, target, wide, lambda, lget, KERNEL_ANY, 1, 0) \
+  HOPFIELD_KERNEL(name##_i_any, target, wide, lambda, lget, KERNEL_ANY, 1, 1)
+
+#define HOPFIELD_KERNELS_ISA(name, target, wide) \
+  HOPFIELD_KERNELS(name##_none, target, wide, HOPFIELD_LAMBDA_NONE, NULL) \
+  HOPFIELD_KERNELS(name##_const, target, wide, HOPFIELD_LAMBDA_CONST, NULL) \
+  HOPFIELD_KERNELS(name##_mirror, target, wide, HOPFIELD_LAMBDA_ADAPTIVE, lambda_get_mirror) \
+  HOPFIELD_KERNELS(name##_period, target, wide, HOPFIELD_LAMBDA_ADAPTIVE, lambda_get_period)
+
+#define HOPFIELD_KERNEL_ROW(name) \
+  { name##_field, name##_1, name##_2, name##_3, name##_4, \
+    name##_5, name##_6, name##_7, name##_8, name##_any }
+
+#define HOPFIELD_KERNEL_ROW_Q(name) \
+  { name##_q_field, name##_q_any, name##_q_any, name##_q_any, name##_q_any, \
+    name##_q_any, name##_q_any, name##_q_any, name##_q_any, name##_q_any }
+
+#define HOPFIELD_KERNEL_ROW_I(name) \
+  { name##_q_field, name##_i_any, name##_i_any, name##_i_any, name##_i_any, \
+    name##_i_any, name##_i_any, name##_i_any, name##_i_any, name##_i_any }
+
+#define HOPFIELD_KERNEL_TABLE(name) \
+  { { HOPFIELD_KERNEL_ROW(name##_none), \
+      HOPFIELD_KERNEL_ROW(name##_const), \
+      HOPFIELD_KERNEL_ROW(name##_mirror), \
+      HOPFIELD_KERNEL_ROW(name##_period) }, \
+    { HOPFIELD_KERNEL_ROW_Q(name##_none), \
+      HOPFIELD_KERNEL_ROW_Q(name##_const), \
+      HOPFIELD_KERNEL_ROW_Q(name##_mirror), \
+      HOPFIELD_KERNEL_ROW_Q(name##_period) }, \
+    { HOPFIELD_KERNEL_ROW_I(name##_none), \
+      HOPFIELD_KERNEL_ROW_I(name##_const), \
+      HOPFIELD_KERNEL_ROW_I(name##_mirror), \
+      HOPFIELD_KERNEL_ROW_I(name##_period) } }
+
+HOPFIELD_KERNELS_ISA(hopfield_sweep_generic, , 0)
+HOPFIELD_KERNELS_ISA(hopfield_sweep_avx2, CPU_TARGET_AVX2, 0)
+HOPFIELD_KERNELS_ISA(hopfield_sweep_avx512, CPU_TARGET_AVX512, 1)
+
+static const hopfield_kernel_t hopfield_kernels[CPU_ISA_LAST][3][4][KERNEL_ANY + 1] = {
+  HOPFIELD_KERNEL_TABLE(hopfield_sweep_generic),
+  HOPFIELD_KERNEL_TABLE(hopfield_sweep_avx2),
+  HOPFIELD_KERNEL_TABLE(hopfield_sweep_avx512)
+};
+
+/* Pick the kernel for the host, the state, the current lambda mode and
+ * tap radius. */
+static double hopfield_sweep_region(hopfield_t* hopfield, image_halo_t* src, int i0, int i1, int j0, int j1, int* changed) {
+  int state, mode, R;
+
+  if (hopfield->lambdafld && hopfield->lambda > 1e-8) mode = (hopfield->mirror ? 2 : 3);
+  else if (hopfield->lambda != 0.0) mode = 1;
+  else mode = 0;
+
+  R = max(hopfield->weights.rxnz, hopfield->weights.rynz);
+  if (R == 0 || R > HOPFIELD_KERNEL_R) R = KERNEL_ANY;
+  if (hopfield->field) R = KERNEL_FIELD;
+
+  if (!src->data8) state = 0;
+  else if (hopfield->fixed_point) state = 2;
+  else state = 1;
+  return hopfield_kernels[cpu_isa()][state][mode][R](hopfield, src, i0, i1, j0, j1, changed);
+}
+
+/* Tiles are at least as wide as the tap radius, so a pixel of tile
+ * (tx,ty) only sees its own and the 8 adjacent tiles. Its local fields
+ * are unchanged, and none of its pixels can move, unless one of these
+ * tiles changed since (tx,ty) was swept last. */
+static int hopfield_tile_active(hopfield_t* hopfield, int tx, int ty) {
+  hopfield_tiles_t* tiles;
+  int dx, dy, ux, uy, u;
+
+  tiles = &(hopfield->tiles);
+  for (dy = -1; dy <= 1; dy++) {
+    for (dx = -1; dx <= 1; dx++) {
+      ux = tx + dx;
+      uy = ty + dy;
+      if (hopfield->mirror) {
+        if (ux < 0 || ux >= tiles->nx || uy < 0 || uy >= tiles->ny)
+          continue;
+      } else {
+        ux = (ux + tiles->nx) % tiles->nx;
+        uy = (uy + tiles->ny) % tiles->ny;
       }
+      u = uy * tiles->nx + ux;
+      if (tiles->prev[u] || tiles->changed[u])
+        return 1;
+    }
+  }
+  return 0;
+}
 
-      lmbd00  = lambda_get_mirror(hopfield->lambdafld, i  , j  );
-      lmbd01  = lambda_get_mirror(hopfield->lambdafld, i  , j+1);
-      lmbd10  = lambda_get_mirror(hopfield->lambdafld, i+1, j  );
-      lmbd_10 = lambda_get_mirror(hopfield->lambdafld, i-1, j  );
-      lmbd0_1 = lambda_get_mirror(hopfield->lambdafld, i  , j-1);
-
-      pom = (lmbd01 + lmbd10 + lmbd_10 + lmbd0_1 + 16.0 * lmbd00);
-      z = pom * image_get_mirror(hopfield->image, i, j);
-      z += lmbd10 * image_get_mirror(hopfield->image, i+2, j);
-      z += lmbd_10 * image_get_mirror(hopfield->image, i-2, j);
-      z += (lmbd10 + lmbd0_1) * image_get_mirror(hopfield->image, i+1, j-1);
-      z += (lmbd01 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j+1);
-      z += (lmbd10 + lmbd01) * image_get_mirror(hopfield->image, i+1, j+1);
-      z += (lmbd0_1 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j-1);
-      z += -4.0 * (lmbd10 + lmbd00) * image_get_mirror(hopfield->image, i+1, j);
-      z += -4.0 * (lmbd00 + lmbd_10) * image_get_mirror(hopfield->image, i-1, j);
-      z += lmbd01 * image_get_mirror(hopfield->image, i, j+2);
-      z += lmbd0_1 * image_get_mirror(hopfield->image, i, j-2);
-      z += -4.0 * (lmbd01 + lmbd00) * image_get_mirror(hopfield->image, i, j+1);
-      z += -4.0 * (lmbd00 + lmbd0_1) * image_get_mirror(hopfield->image, i, j-1);
-
-      s -= hopfield->lambda*z;
-      pom = -pom;
-      pom *= hopfield->lambda;
+/* Multi-colour sweep: the tiles are coloured like a 2x2 checkerboard and
+ * are at least twice the weight radius wide, so neither the taps nor the
+ * field updates of two tiles with the same colour overlap. Tiles of one
+ * colour are swept in parallel, each in the usual sequential order, so
+ * every single update still lowers the energy. With the active set,
+ * tiles whose neighbourhood is at rest are skipped. */
+static double hopfield_iteration_tiles(hopfield_t* hopfield) {
+  hopfield_tiles_t* tiles;
+  int colour, t, n;
+  double Sum;
 
-      s += threshold_get(&(hopfield->threshold), i, j);
-      s *= 255.0; /* adjust image from 0.0..1.0 to 0.0..255.0 */
-      pom += weights_get(&(hopfield->weights), 0, 0);
-
-      ddui = hardlim(s);
-      dE = -2.0 * s * ddui - pom;
-      if (dE < 0.0) {
-        value = image_get(hopfield->image, i, j);
-        value8 = (int)(255.0 * value + 0.5);
-        k = (s >= 0.0 ? 1 :-1);
-        k -= (int)(s/pom);
-        if (k > 0 && value8 < 255) {
-          k = min(k, 255 - value8);
-          k = (rand()%k) + 1;
-          value8 += k;
-          dk = k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        } else if (k < 0 && value8 > 0) {
-          k = min(-k, value8);
-          k = (rand()%k) + 1;
-          value8 -= k;
-          dk = -k;
-          dE = (-2.0*s - pom*dk)*dk;
-          Sum += dE;
-          image_set(hopfield->image, i, j, (value8/255.0));
-        }
-      }
+  tiles = &(hopfield->tiles);
+  n = tiles->nx * tiles->ny;
+  for (t = 0; t < n; t++) {
+    tiles->prev[t] = tiles->changed[t];
+    tiles->changed[t] = 0;
+    tiles->sum[t] = 0.0;
+  }
+
+  for (colour = 0; colour < 4; colour++) {
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(max(hopfield->threads, 1)) schedule(dynamic)
+#endif
+    for (t = 0; t < n; t++) {
+      int tx, ty;
+
+      tx = t % tiles->nx;
+      ty = t / tiles->nx;
+      if ((tx & 1) + 2 * (ty & 1) != colour)
+        continue;
+      if (hopfield->active && !hopfield_tile_active(hopfield, tx, ty))
+        continue;
+      tiles->sum[t] = hopfield_sweep_region(hopfield, &(hopfield->state), tiles->x[tx], tiles->x[tx+1],
+                                            tiles->y[ty], tiles->y[ty+1], &(tiles->changed[t]));
     }
   }
+
+  Sum = 0.0;
+  for (t = 0; t < n; t++) {
+    Sum += tiles->sum[t];
+    hopfield->changed += tiles->changed[t];
+  }
+  return Sum;
+}
+
+/* Synchronous (Jacobi) sweep: every local field is evaluated on a frozen
+ * copy of the image and the steps are damped, so all tiles are independent
+ * and can run in parallel without any colouring. With a field the weight
+ * correlations of the whole frozen image come from one overlap-save FFT
+ * with the spectrum built in hopfield_create() before the sweep, the taps
+ * are the fallback if it runs out of memory. The sum returned adds up the
+ * energy change of every step taken alone against the frozen copy, an
+ * estimate of the change of the joint update, which is what
+ * hopfield_converged() then compares. */
+static double hopfield_iteration_synchronous(hopfield_t* hopfield) {
+  hopfield_tiles_t* tiles;
+  int t, n;
+  double Sum;
+
+  tiles = &(hopfield->tiles);
+  n = tiles->nx * tiles->ny;
+  image_halo_copy(&(hopfield->frozen), &(hopfield->state));
+  if (hopfield->field &&
+      !(image_correlate_fft(hopfield->field, hopfield->image, &(hopfield->fft), hopfield->mirror,
+                            &(hopfield->arena)))) {
+    free(hopfield->field);
+    hopfield->field = NULL;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(max(hopfield->threads, 1)) schedule(dynamic)
+#endif
+  for (t = 0; t < n; t++) {
+    int tx, ty;
+
+    tx = t % tiles->nx;
+    ty = t / tiles->nx;
+    tiles->changed[t] = 0;
+    tiles->sum[t] = hopfield_sweep_region(hopfield, &(hopfield->frozen), tiles->x[tx], tiles->x[tx+1],
+                                          tiles->y[ty], tiles->y[ty+1], &(tiles->changed[t]));
+  }
+
+  Sum = 0.0;
+  for (t = 0; t < n; t++) {
+    Sum += tiles->sum[t];
+    hopfield->changed += tiles->changed[t];
+  }
   return Sum;
 }
 
 static hopfield_t* hopfield_create_mirror(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
   hopfield->image = image;
   hopfield->mirror = 1;
-  if (!(weights_create(&(hopfield->weights), convmask)))
+  if (!(hopfield->shared ? weights_share(&(hopfield->weights), hopfield->shared)
+                         : weights_create(&(hopfield->weights), convmask)))
     return NULL;
   if (!(threshold_create_mirror(&(hopfield->threshold), convmask, image))) {
     weights_destroy(&(hopfield->weights));
@@ -386,7 +592,8 @@ static hopfield_t* hopfield_create_mirror(hopfield_t* hopfield, convmask_t* conv
 static hopfield_t* hopfield_create_period(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
   hopfield->image = image;
   hopfield->mirror = 0;
-  if (!(weights_create(&(hopfield->weights), convmask)))
+  if (!(hopfield->shared ? weights_share(&(hopfield->weights), hopfield->shared)
+                         : weights_create(&(hopfield->weights), convmask)))
     return NULL;
   if (!(threshold_create_mirror(&(hopfield->threshold), convmask, image))) {
     weights_destroy(&(hopfield->weights));
@@ -396,30 +603,359 @@ static hopfield_t* hopfield_create_period(hopfield_t* hopfield, convmask_t* conv
   return hopfield;
 }
 
+/* Round the image onto the 256 levels the quantized state can hold, so
+ * that it keeps matching the state the sweeps read. */
+static void hopfield_quantize(hopfield_t* hopfield) {
+  int i, n;
+  real_t* data;
+
+  if (!hopfield->quantized && !hopfield->fixed_point)
+    return;
+  data = hopfield->image->data;
+  n = hopfield->image->x * hopfield->image->y;
+  for (i = 0; i < n; i++) {
+    data[i] = (real_t)((int)(255.0 * min(max(data[i], 0.0), 1.0) + 0.5) / 255.0);
+  }
+  if (hopfield->lambdafld)
+    lambda_invalidate(hopfield->lambdafld);
+}
+
+/* Halo-padded copy of the image the sweeps read from, wide enough for
+ * the weight taps and the smoothing stencil. */
+static hopfield_t* hopfield_create_state(hopfield_t* hopfield) {
+  int halo;
+  image_halo_t* rv;
+
+  halo = max(max(hopfield->weights.rxnz, hopfield->weights.rynz), 2);
+  if (hopfield->quantized || hopfield->fixed_point)
+    rv = image_halo_create_quantized(&(hopfield->state), hopfield->image->x, hopfield->image->y, halo, hopfield->mirror);
+  else
+    rv = image_halo_create(&(hopfield->state), hopfield->image->x, hopfield->image->y, halo, hopfield->mirror);
+  if (!rv)
+    return NULL;
+  hopfield_quantize(hopfield);
+  image_halo_fill(&(hopfield->state), hopfield->image);
+  return hopfield;
+}
+
+/* Synchronous sweeps take the field of the frozen image by FFT where
+ * that costs less than the taps. The spectrum of the weights, as a
+ * (2r+1)^2 mask, is transformed once here for all the sweeps. */
+static hopfield_t* hopfield_create_fft(hopfield_t* hopfield) {
+  int x, y, r, n, p, q;
+  double* taps;
+  image_fft_t* rv;
+
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  r = max(hopfield->weights.rxnz, hopfield->weights.rynz);
+  if (!(n = image_correlate_fft_size(x, y, r)))
+    return hopfield;
+  if (!(taps = (double*)malloc(sizeof(double) * (2 * r + 1) * (2 * r + 1))))
+    return NULL;
+  for (q = -r; q <= r; q++) {
+    for (p = -r; p <= r; p++) {
+      taps[(q + r) * (2 * r + 1) + p + r] = weights_get(&(hopfield->weights), p, q);
+    }
+  }
+  rv = image_fft_create(&(hopfield->fft), taps, r, n);
+  free(taps);
+  if (!rv)
+    return NULL;
+  if (!(hopfield->field = (double*)malloc(sizeof(double) * x * y)))
+    return NULL;
+  return hopfield;
+}
+
+/* The 16 bit taps are built for fixed point sweeps only. */
+static hopfield_t* hopfield_create_fixed(hopfield_t* hopfield) {
+  if (hopfield->fixed_point && !weights_create_fixed(&(hopfield->weights)))
+    return NULL;
+  return hopfield;
+}
+
+static hopfield_t* hopfield_create_field(hopfield_t* hopfield) {
+  int x, y;
+
+  if (hopfield->fixed_point)
+    return hopfield;
+  if (hopfield->synchronous)
+    return hopfield_create_fft(hopfield);
+  if (!hopfield->incremental)
+    return hopfield;
+
+  /* boundaries fold taps back only once, else keep the direct sweep */
+  x = hopfield->image->x;
+  y = hopfield->image->y;
+  if (hopfield->weights.rxnz >= x - 1 || hopfield->weights.rynz >= y - 1)
+    return hopfield;
+
+  if (!(hopfield->field = (double*)malloc(sizeof(double) * x * y)))
+    return NULL;
+  hopfield_field_init(hopfield);
+  return hopfield;
+}
+
+/* Split l pixels into tiles at least twice the tap radius r wide. With
+ * periodic boundaries the first and last tile touch, so their count must
+ * be even for them to get different colours. */
+static int hopfield_tiles_split(int l, int r, int mirror, int** bounds) {
+  int n, t;
+
+  n = l / max(HOPFIELD_TILE_SIZE, 2 * max(r, 2));
+  if (n < 1) n = 1;
+  if (!mirror && n > 1 && (n & 1)) n--;
+  if (!(*bounds = (int*)malloc(sizeof(int) * (n + 1))))
+    return 0;
+  for (t = 0; t <= n; t++) {
+    (*bounds)[t] = (int)((long)t * l / n);
+  }
+  return n;
+}
+
+/* Every sweep but the legacy column order walks the same tiles in the
+ * same colour order, one thread or many, so the results do not depend
+ * on the number of threads. */
+static hopfield_t* hopfield_create_tiles(hopfield_t* hopfield) {
+  hopfield_tiles_t* tiles;
+  int n;
+
+  if (hopfield->column_order && !hopfield->synchronous)
+    return hopfield;
+
+  tiles = &(hopfield->tiles);
+  if (!(tiles->nx = hopfield_tiles_split(hopfield->image->x, hopfield->weights.rxnz, hopfield->mirror, &(tiles->x))))
+    return NULL;
+  if (!(tiles->ny = hopfield_tiles_split(hopfield->image->y, hopfield->weights.rynz, hopfield->mirror, &(tiles->y))))
+    return NULL;
+  n = tiles->nx * tiles->ny;
+  if (!(tiles->sum = (double*)malloc(sizeof(double) * n)))
+    return NULL;
+  if (!(tiles->changed = (int*)malloc(sizeof(int) * n)))
+    return NULL;
+  if (!(tiles->prev = (int*)malloc(sizeof(int) * n)))
+    return NULL;
+  hopfield_invalidate(hopfield);
+  return hopfield;
+}
+
+/* Damping of the synchronous update: the self coupling over a Gershgorin
+ * bound of the couplings. With it the damped Jacobi step lowers the
+ * energy, but the steps are rounded stochastically to whole levels, so
+ * the energy only descends in expectation, not at every sweep. */
+static double hopfield_damping(hopfield_t* hopfield) {
+  int p, r;
+  double sum, pom;
+
+  sum = 64.0 * hopfield->lambda; /* sum of |20,-8,2,1| smoothing coefficients */
+  for (p = -hopfield->weights.rxnz; p <= hopfield->weights.rxnz; p++) {
+    for (r = -hopfield->weights.rynz; r <= hopfield->weights.rynz; r++) {
+      sum += fabs(weights_get(&(hopfield->weights), p, r));
+    }
+  }
+  pom = weights_get(&(hopfield->weights), 0, 0);
+  if (!hopfield->lambdafld)
+    pom -= 20.0 * hopfield->lambda;
+  return fabs(pom) / sum;
+}
+
+static hopfield_t* hopfield_create_frozen(hopfield_t* hopfield) {
+  if (!hopfield->synchronous)
+    return hopfield;
+
+  /* damping keeps the setting, copies for other masks compute their own */
+  if (hopfield->damping <= 0.0 || hopfield->damping > 1.0)
+    hopfield->step = hopfield_damping(hopfield);
+  else
+    hopfield->step = hopfield->damping;
+  if (hopfield->quantized || hopfield->fixed_point)
+    return (image_halo_create_quantized(&(hopfield->frozen), hopfield->state.x, hopfield->state.y,
+                                        hopfield->state.halo, hopfield->mirror) ? hopfield : NULL);
+  return (image_halo_create(&(hopfield->frozen), hopfield->state.x, hopfield->state.y,
+                            hopfield->state.halo, hopfield->mirror) ? hopfield : NULL);
+}
+
 /* Public functions */
 
 hopfield_t* hopfield_create(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld) {
-  if (hopfield->mirror) return hopfield_create_mirror(hopfield, convmask, image, lambdafld);
-  else return hopfield_create_period(hopfield, convmask, image, lambdafld);
+  hopfield_t* rv;
+
+  hopfield->field = NULL;
+  hopfield->fft.n = 0;
+  hopfield->fft.h = NULL;
+  arena_create(&(hopfield->arena));
+  hopfield->tiles.x = hopfield->tiles.y = NULL;
+  hopfield->tiles.sum = NULL;
+  hopfield->tiles.changed = NULL;
+  hopfield->tiles.prev = NULL;
+  hopfield->state.mem = NULL;
+  hopfield->frozen.mem = NULL;
+  hopfield->iteration = 0;
+  hopfield->changed = 0;
+  hopfield->energy = 0.0;
+  hopfield->energy_max = 0.0;
+  /* the first call is not thread safe, make it before any parallel sweep */
+  cpu_isa();
+
+  if (hopfield->mirror) rv = hopfield_create_mirror(hopfield, convmask, image, lambdafld);
+  else rv = hopfield_create_period(hopfield, convmask, image, lambdafld);
+  if (rv && !(hopfield_create_state(hopfield) && hopfield_create_fixed(hopfield) && hopfield_create_field(hopfield) &&
+              hopfield_create_tiles(hopfield) && hopfield_create_frozen(hopfield))) {
+#if defined(NDEBUG)
+    printf("Error, hopfield_create() - Out of memory!\n");
+#endif
+    hopfield_destroy(hopfield);
+    rv = NULL;
+  }
+  return rv;
 }
 
 void hopfield_destroy(hopfield_t* hopfield) {
   weights_destroy(&(hopfield->weights));
   threshold_destroy(&(hopfield->threshold));
+  free(hopfield->field);
+  image_fft_destroy(&(hopfield->fft));
+  arena_destroy(&(hopfield->arena));
+  free(hopfield->tiles.x);
+  free(hopfield->tiles.y);
+  free(hopfield->tiles.sum);
+  free(hopfield->tiles.changed);
+  free(hopfield->tiles.prev);
+  image_halo_destroy(&(hopfield->state));
+  image_halo_destroy(&(hopfield->frozen));
 }
 
 double hopfield_iteration(hopfield_t* hopfield) {
   double rv;
-  if (hopfield->mirror) {
-    if (hopfield->lambdafld && hopfield->lambda > 1e-8) rv = hopfield_iteration_mirror_lambda(hopfield);
-    else rv = hopfield_iteration_mirror(hopfield);
+  hopfield->changed = 0;
+  if (hopfield->synchronous) {
+    rv = hopfield_iteration_synchronous(hopfield);
+  } else if (hopfield->tiles.sum) {
+    rv = hopfield_iteration_tiles(hopfield);
   } else {
-    if (hopfield->lambdafld && hopfield->lambda > 1e-8) rv = hopfield_iteration_period_lambda(hopfield);
-    else rv = hopfield_iteration_period(hopfield);
+    rv = hopfield_sweep_region(hopfield, &(hopfield->state), 0, hopfield->image->x, 0, hopfield->image->y,
+                               &(hopfield->changed));
   }
+  hopfield->iteration++;
+  hopfield->energy = rv;
+  if (-rv > hopfield->energy_max)
+    hopfield->energy_max = -rv;
   return rv;
 }
 
+/* Stopping criterion after a sweep: the energy decrease fell below
+ * tolerance times the largest decrease seen so far, or less than
+ * tolerance of all pixels changed. Tolerance 0.0 never converges. The
+ * decrease of a synchronous sweep is only the estimate summed by
+ * hopfield_iteration_synchronous(). */
+int hopfield_converged(hopfield_t* hopfield, double tolerance) {
+  if (tolerance <= 0.0 || hopfield->iteration < 2)
+    return 0;
+  if (-hopfield->energy <= tolerance * hopfield->energy_max)
+    return 1;
+  return (hopfield->changed <= tolerance * hopfield->image->x * hopfield->image->y);
+}
+
+/* The image was changed outside of hopfield_iteration(). */
+void hopfield_refresh(hopfield_t* hopfield) {
+  hopfield_quantize(hopfield);
+  if (hopfield->lambdafld)
+    lambda_invalidate(hopfield->lambdafld);
+  image_halo_fill(&(hopfield->state), hopfield->image);
+  if (hopfield->field && !hopfield->synchronous)
+    hopfield_field_init(hopfield);
+  hopfield_invalidate(hopfield);
+}
+
+/* The local fields changed everywhere (new image or lambda field),
+ * sweep all tiles again. */
+void hopfield_invalidate(hopfield_t* hopfield) {
+  int t;
+
+  if (!hopfield->tiles.changed)
+    return;
+  for (t = 0; t < hopfield->tiles.nx * hopfield->tiles.ny; t++) {
+    hopfield->tiles.changed[t] = 1;
+  }
+}
+
+/* The lambda field was calculated again. The smoothing stencil of a
+ * pixel reads lambda one pixel around it, so only tiles within a pixel
+ * of the blocks in which lambda moved are swept again. */
+void hopfield_invalidate_lambda(hopfield_t* hopfield) {
+  hopfield_tiles_t* tiles;
+  int tx, ty;
+
+  tiles = &(hopfield->tiles);
+  if (!tiles->changed || !hopfield->lambdafld)
+    return;
+  for (ty = 0; ty < tiles->ny; ty++) {
+    for (tx = 0; tx < tiles->nx; tx++) {
+      if (lambda_moved(hopfield->lambdafld, tiles->x[tx] - 1, tiles->x[tx+1] + 1, tiles->y[ty] - 1, tiles->y[ty+1] + 1))
+        tiles->changed[ty * tiles->nx + tx] = 1;
+    }
+  }
+}
+
 void hopfield_set_mirror(hopfield_t* hopfield, int mirror) {
   hopfield->mirror = mirror;
 }
+
+void hopfield_set_incremental(hopfield_t* hopfield, int incremental) {
+  hopfield->incremental = incremental;
+}
+
+void hopfield_set_threads(hopfield_t* hopfield, int threads) {
+  hopfield->threads = threads;
+}
+
+void hopfield_set_active(hopfield_t* hopfield, int active) {
+  hopfield->active = active;
+}
+
+void hopfield_set_column_order(hopfield_t* hopfield, int column_order) {
+  hopfield->column_order = column_order;
+}
+
+void hopfield_set_seed(hopfield_t* hopfield, unsigned int seed) {
+  hopfield->seed = seed;
+}
+
+void hopfield_set_synchronous(hopfield_t* hopfield, int synchronous) {
+  hopfield->synchronous = synchronous;
+}
+
+/* Step damping of the synchronous update in 0..1, any other value takes
+ * the bound of the mask given to hopfield_create(). */
+void hopfield_set_damping(hopfield_t* hopfield, double damping) {
+  hopfield->damping = damping;
+}
+
+/* Keep the sweep state as 8 bit levels. The image is rounded to the
+ * nearest level once in hopfield_create() and hopfield_refresh(), at
+ * most 0.5/255 off the double state. The sweeps read the levels through
+ * image_levels[], which holds exactly the values the double path stores,
+ * so from there on both give the same results at an eighth of the state
+ * memory (with USE_FLOAT the tap rows are summed in double, not float).
+ * The table lookups cost more than the plain loads once the state fits
+ * the cache. */
+void hopfield_set_quantized(hopfield_t* hopfield, int quantized) {
+  hopfield->quantized = quantized;
+}
+
+/* Evaluate the local fields in integers: the 8 bit levels of the
+ * quantized state (implied) times the 16 bit weights wq, summed in 32 bit.
+ * The fields are at most weights.qerror off, for defocus blurs of radius
+ * 2..12 that is below 1.6e-4, or 0.04 of a level. Every sweep takes the
+ * direct taps, the incremental and the FFT field are kept in double and
+ * are not used. */
+void hopfield_set_fixed_point(hopfield_t* hopfield, int fixed_point) {
+  hopfield->fixed_point = fixed_point;
+}
+
+/* Take the weights from weights instead of calculating them from the
+ * mask given to hopfield_create(), which they must have been made from.
+ * NULL calculates them again. */
+void hopfield_set_weights(hopfield_t* hopfield, weights_t* weights) {
+  hopfield->shared = weights;
+}
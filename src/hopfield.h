@@ -27,19 +27,62 @@
 
 C_DECL_BEGIN
 
+typedef struct {
+  int     nx, ny;
+  int    *x, *y;
+  double *sum;
+  int    *changed;
+  int    *prev;
+} hopfield_tiles_t;
+
 typedef struct {
   int         mirror;
+  int         incremental;
+  int         threads;
+  int         active;
+  int         column_order;
+  int         synchronous;
+  double      damping;
+  double      step;
+  int         quantized;
+  int         fixed_point;
+  unsigned int seed;
+  unsigned int iteration;
+  int         changed;
+  double      energy;
+  double      energy_max;
   image_t    *image;
+  image_halo_t state;
+  image_halo_t frozen;
   weights_t   weights;
+  weights_t  *shared;
   double      lambda;
   lambda_t   *lambdafld;
   threshold_t threshold;
+  double     *field;
+  image_fft_t fft;
+  arena_t     arena;
+  hopfield_tiles_t tiles;
 } hopfield_t;
 
 hopfield_t* hopfield_create(hopfield_t* hopfield, convmask_t* convmask, image_t* image, lambda_t* lambdafld);
 void hopfield_set_mirror(hopfield_t* hopfield, int mirror);
+void hopfield_set_incremental(hopfield_t* hopfield, int incremental);
+void hopfield_set_threads(hopfield_t* hopfield, int threads);
+void hopfield_set_active(hopfield_t* hopfield, int active);
+void hopfield_set_column_order(hopfield_t* hopfield, int column_order);
+void hopfield_set_seed(hopfield_t* hopfield, unsigned int seed);
+void hopfield_set_synchronous(hopfield_t* hopfield, int synchronous);
+void hopfield_set_damping(hopfield_t* hopfield, double damping);
+void hopfield_set_quantized(hopfield_t* hopfield, int quantized);
+void hopfield_set_fixed_point(hopfield_t* hopfield, int fixed_point);
+void hopfield_set_weights(hopfield_t* hopfield, weights_t* weights);
 void hopfield_destroy(hopfield_t* hopfield);
 double hopfield_iteration(hopfield_t* hopfield);
+int hopfield_converged(hopfield_t* hopfield, double tolerance);
+void hopfield_refresh(hopfield_t* hopfield);
+void hopfield_invalidate(hopfield_t* hopfield);
+void hopfield_invalidate_lambda(hopfield_t* hopfield);
 
 C_DECL_END
 
@@ -19,11 +19,14 @@
 #include <string.h>
 #include <errno.h>
 #include "image.h"
+#include "cpu.h"
+#include "simd.h"
+#include "fft.h"
 
 image_t* image_create(image_t* image, int x, int y) {
   image->x = x;
   image->y = y;
-  if ((image->data = (double*)malloc(sizeof(double) * x * y)))
+  if ((image->data = (real_t*)malloc(sizeof(real_t) * x * y)))
     return image;
   return NULL;
 }
@@ -31,7 +34,17 @@ image_t* image_create(image_t* image, int x, int y) {
 image_t* image_create_copyparam(image_t* image, image_t* src) {
   image->x = src->x;
   image->y = src->y;
-  if ((image->data = (double*)malloc(sizeof(double) * image->x * image->y)))
+  if ((image->data = (real_t*)malloc(sizeof(real_t) * image->x * image->y)))
+    return image;
+  return NULL;
+}
+
+/* Scratch image in the arena, given back by arena_release() instead of
+ * image_destroy(). */
+image_t* image_create_arena(image_t* image, int x, int y, arena_t* arena) {
+  image->x = x;
+  image->y = y;
+  if ((image->data = (real_t*)arena_alloc(arena, sizeof(real_t) * x * y)))
     return image;
   return NULL;
 }
@@ -54,39 +67,363 @@ void image_set(image_t* image, int x, int y, double value) {
   image->data[y * image->x + x] = value;
 }
 
-image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter) {
-  int i, j, k, l, r;
+/* dst(i,j) is the sum of mask(k,l) * src(i+k,j+l) for |k|,|l| <= r, the
+ * mask is stored row by row, (2r+1) x (2r+1). Every mask row is a dot
+ * product with a plain row of the halo copy, wide for AVX-512. dst has
+ * the size of src and its rows lie stride pixels apart. */
+ALWAYS_INLINE void image_correlate_body(real_t* dst, int stride, image_halo_t* src, const real_t* mask, int r,
+                                        int wide) {
+  int i, j, l, n;
+  int i0, i1;
   double value;
 
-  r = filter->radius;
-  for (i = 0; i < src->x; i++) {
+  n = 2 * r + 1;
+  for (i0 = 0; i0 < src->x; i0 += IMAGE_BLOCK) {
+    i1 = (i0 + IMAGE_BLOCK < src->x ? i0 + IMAGE_BLOCK : src->x);
     for (j = 0; j < src->y; j++) {
-      value = 0.0;
-      for (k = -r; k <= r; k++) {
+      for (i = i0; i < i1; i++) {
+        value = 0.0;
         for (l = -r; l <= r; l++) {
-          value += convmask_get(filter, k,l) * image_get_mirror(src, i-k, j-l);
+          if (wide) value += simd_dot_wide(mask + (l + r) * n, &image_halo_get(src, i - r, j + l), n);
+          else value += simd_dot(mask + (l + r) * n, &image_halo_get(src, i - r, j + l), n);
+        }
+        dst[(size_t)j * stride + i] = value;
+      }
+    }
+  }
+}
+
+static void image_correlate_generic(real_t* dst, int stride, image_halo_t* src, const real_t* mask, int r) {
+  image_correlate_body(dst, stride, src, mask, r, 0);
+}
+
+CPU_TARGET_AVX2 static void image_correlate_avx2(real_t* dst, int stride, image_halo_t* src, const real_t* mask,
+                                                 int r) {
+  image_correlate_body(dst, stride, src, mask, r, 0);
+}
+
+CPU_TARGET_AVX512 static void image_correlate_avx512(real_t* dst, int stride, image_halo_t* src, const real_t* mask,
+                                                     int r) {
+  image_correlate_body(dst, stride, src, mask, r, 1);
+}
+
+/* Transform plan and spectrum of a (2r+1)^2 mask for overlap-save blocks
+ * of n x n pixels, n from image_correlate_fft_size(), so that many images
+ * can be correlated with the mask without transforming it again. */
+image_fft_t* image_fft_create(image_fft_t* fft, const double* mask, int r, int n) {
+  int k, l;
+
+  fft->n = n;
+  fft->r = r;
+  if (!(fft_create(&(fft->plan), n)))
+    return NULL;
+  if (!(fft->h = fft_plane(&(fft->plan)))) {
+    fft_destroy(&(fft->plan));
+    return NULL;
+  }
+
+  /* dst(i,j) = sum of mask(k,l) * src(i+k,j+l) is the cyclic convolution
+   * with h(-k,-l) = mask(k,l) */
+  for (l = -r; l <= r; l++) {
+    for (k = -r; k <= r; k++) {
+      fft->h[2 * (((n - l) % n) * n + (n - k) % n)] = mask[(l + r) * (2 * r + 1) + k + r];
+    }
+  }
+  fft_2d(&(fft->plan), fft->h, 0);
+  return fft;
+}
+
+void image_fft_destroy(image_fft_t* fft) {
+  if (!fft->h)
+    return;
+  fft_destroy(&(fft->plan));
+  free(fft->h);
+  fft->h = NULL;
+}
+
+/* Overlap-save: the image is cut into tiles of n - 2r pixels, and each
+ * tile is read with its r pixel margins from the halo copy into an n x n
+ * block, so the boundaries are those of the direct sums. The mask is
+ * real, so two tiles share one transform, one in the real parts and one
+ * in the imaginary parts. */
+static double* image_correlate_blocks(double* dst, image_halo_t* src, image_fft_t* fft, arena_t* arena) {
+  double *h, *z, re;
+  int a, b, k, p, t, n, r, i0, j0, tx, count, size;
+
+  n = fft->n;
+  r = fft->r;
+  h = fft->h;
+  size = n - 2 * r;
+  tx = (src->x + size - 1) / size;
+  count = tx * ((src->y + size - 1) / size);
+  if (!(z = (double*)arena_alloc(arena, sizeof(double) * 2 * n * n)))
+    return NULL;
+
+  for (t = 0; t < count; t += 2) {
+    memset(z, 0, sizeof(double) * 2 * n * n);
+    for (p = 0; p < 2 && t + p < count; p++) {
+      i0 = ((t + p) % tx) * size;
+      j0 = ((t + p) / tx) * size;
+      for (b = 0; b < n && j0 - r + b < src->y + r; b++) {
+        for (a = 0; a < n && i0 - r + a < src->x + r; a++) {
+          z[2 * (b * n + a) + p] = image_halo_get(src, i0 - r + a, j0 - r + b);
+        }
+      }
+    }
+    fft_2d(&(fft->plan), z, 0);
+    for (k = 0; k < n * n; k++) {
+      re = z[2 * k] * h[2 * k] - z[2 * k + 1] * h[2 * k + 1];
+      z[2 * k + 1] = z[2 * k] * h[2 * k + 1] + z[2 * k + 1] * h[2 * k];
+      z[2 * k] = re;
+    }
+    fft_2d(&(fft->plan), z, 1);
+    for (p = 0; p < 2 && t + p < count; p++) {
+      i0 = ((t + p) % tx) * size;
+      j0 = ((t + p) / tx) * size;
+      for (b = r; b < n - r && j0 + b - r < src->y; b++) {
+        for (a = r; a < n - r && i0 + a - r < src->x; a++) {
+          dst[(size_t)(j0 + b - r) * src->x + i0 + a - r] = z[2 * (b * n + a) + p];
         }
       }
-      image_set(dst, i, j, value);
     }
   }
   return dst;
 }
 
-image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter) {
-  int i, j, k, l, r;
-  double value;
+/* Block size of the overlap-save correlation with the least work, in
+ * multiply-adds of the direct sums, or 0 if those are cheaper. The vector
+ * loops of the direct sums do IMAGE_FFT_DIRECT of them per butterfly
+ * operation of the transforms. */
+int image_correlate_fft_size(int x, int y, int r) {
+  double cost, best;
+  int n, size, tiles, rv;
 
+  best = (double)x * y * (2 * r + 1) * (2 * r + 1) / IMAGE_FFT_DIRECT;
+  rv = 0;
+  for (n = fft_size(4 * r + 2); ; n *= 2) {
+    size = n - 2 * r;
+    tiles = ((x + size - 1) / size) * ((y + size - 1) / size);
+    cost = fft_cost(n) * (1 + 2 * ((tiles + 1) / 2));
+    if (cost < best) {
+      best = cost;
+      rv = n;
+    }
+    if (size >= x && size >= y)
+      break;
+  }
+  return rv;
+}
+
+/* image_correlate() with the mask of fft into the x*y doubles of dst. The
+ * temporaries come from arena, or from the heap if it is NULL. */
+double* image_correlate_fft(double* dst, image_t* src, image_fft_t* fft, int mirror, arena_t* arena) {
+  image_halo_t halo;
+  arena_t local;
+  int mark;
+  double* rv;
+
+  if (!arena)
+    arena = arena_create(&local);
+  mark = arena_mark(arena);
+  rv = NULL;
+  if (image_halo_create_arena(&halo, src->x, src->y, fft->r, mirror, arena)) {
+    image_halo_fill(&halo, src);
+    rv = image_correlate_blocks(dst, &halo, fft, arena);
+  }
+  arena_release(arena, mark);
+  if (arena == &local)
+    arena_destroy(&local);
+  return rv;
+}
+
+/* The temporaries come from arena, or from the heap if it is NULL. Large
+ * masks take the overlap-save FFT, which agrees with the direct sums to
+ * the rounding of a transform. */
+image_t* image_correlate(image_t* dst, image_t* src, const double* mask, int r, int mirror, arena_t* arena) {
+  image_halo_t halo;
+  image_fft_t fft;
+  arena_t local;
+  real_t *m;
+  double *f;
+  int k, n, mark;
+  image_t* rv;
+
+  if (!arena)
+    arena = arena_create(&local);
+  mark = arena_mark(arena);
+  rv = NULL;
+  if ((n = image_correlate_fft_size(src->x, src->y, r))) {
+    if ((f = (double*)arena_alloc(arena, sizeof(double) * src->x * src->y)) &&
+        image_fft_create(&fft, mask, r, n)) {
+      if (image_correlate_fft(f, src, &fft, mirror, arena)) {
+        for (k = 0; k < src->x * src->y; k++) {
+          dst->data[k] = f[k];
+        }
+        rv = dst;
+      }
+      image_fft_destroy(&fft);
+    }
+  } else {
+    n = (2 * r + 1) * (2 * r + 1);
+    if ((m = (real_t*)arena_alloc(arena, n * sizeof(real_t))) &&
+        image_halo_create_arena(&halo, src->x, src->y, r, mirror, arena)) {
+      for (k = 0; k < n; k++) {
+        m[k] = mask[k];
+      }
+      image_halo_fill(&halo, src);
+      CPU_SELECT(image_correlate)(dst->data, dst->x, &halo, m, r);
+      rv = dst;
+    }
+  }
+  arena_release(arena, mark);
+  if (arena == &local)
+    arena_destroy(&local);
+  return rv;
+}
+
+/* Separable masks g(k)*g(l): the rows of the halo copy, the halo rows
+ * included, are correlated with g into tmp, then the columns of tmp. The
+ * boundaries are separable as well, so the halo rows of tmp are the
+ * halo of the row pass. Every column sum is a row axpy into acc. */
+ALWAYS_INLINE void image_correlate_separable_body(real_t* dst, int stride, image_halo_t* src, const real_t* g, int r,
+                                                  real_t* tmp, double* acc, int wide) {
+  int i, j, l, n, x;
+
+  n = 2 * r + 1;
+  x = src->x;
+  for (j = -r; j < src->y + r; j++) {
+    for (i = 0; i < x; i++) {
+      if (wide) tmp[(size_t)(j + r) * x + i] = simd_dot_wide(g, &image_halo_get(src, i - r, j), n);
+      else tmp[(size_t)(j + r) * x + i] = simd_dot(g, &image_halo_get(src, i - r, j), n);
+    }
+  }
+  for (j = 0; j < src->y; j++) {
+    for (i = 0; i < x; i++) {
+      acc[i] = 0.0;
+    }
+    for (l = 0; l < n; l++) {
+      simd_axpy(acc, tmp + (size_t)(j + l) * x, g[l], x);
+    }
+    for (i = 0; i < x; i++) {
+      dst[(size_t)j * stride + i] = acc[i];
+    }
+  }
+}
+
+static void image_correlate_separable_generic(real_t* dst, int stride, image_halo_t* src, const real_t* g, int r,
+                                              real_t* tmp, double* acc) {
+  image_correlate_separable_body(dst, stride, src, g, r, tmp, acc, 0);
+}
+
+CPU_TARGET_AVX2 static void image_correlate_separable_avx2(real_t* dst, int stride, image_halo_t* src, const real_t* g,
+                                                           int r, real_t* tmp, double* acc) {
+  image_correlate_separable_body(dst, stride, src, g, r, tmp, acc, 0);
+}
+
+CPU_TARGET_AVX512 static void image_correlate_separable_avx512(real_t* dst, int stride, image_halo_t* src,
+                                                               const real_t* g, int r, real_t* tmp, double* acc) {
+  image_correlate_separable_body(dst, stride, src, g, r, tmp, acc, 1);
+}
+
+/* Convolution is the correlation with the mask turned by 180 degrees,
+ * O(r) per pixel instead of O(r^2) if the mask is separable. Only the
+ * rectangle [i0,i1) x [j0,j1) of dst is written, the halo copy covers
+ * just that rectangle, so a small region costs no more than its size. */
+image_t* image_convolve_region(image_t* dst, image_t* src, convmask_t* filter, int mirror,
+                               int i0, int i1, int j0, int j1, arena_t* arena) {
+  image_halo_t halo;
+  arena_t local;
+  int k, n, r, mark;
+  real_t *m, *tmp, *out;
+  double *acc;
+  image_t* rv;
+
+  if (!arena)
+    arena = arena_create(&local);
+  mark = arena_mark(arena);
+  rv = NULL;
   r = filter->radius;
-  for (i = 0; i < src->x; i++) {
-    for (j = 0; j < src->y; j++) {
-      value = 0.0;
-      for (k = -r; k <= r; k++) {
-        for (l = -r; l <= r; l++) {
-          value += convmask_get(filter, k,l) * image_get_period(src, i-k, j-l);
+  n = (filter->sep ? filter->r21 : filter->r21 * filter->r21);
+  out = dst->data + (size_t)j0 * dst->x + i0;
+  if ((m = (real_t*)arena_alloc(arena, n * sizeof(real_t))) &&
+      image_halo_create_arena(&halo, i1 - i0, j1 - j0, r, mirror, arena)) {
+    image_halo_fill_region(&halo, src, i0, j0);
+    if (filter->sep) {
+      for (k = 0; k < n; k++) {
+        m[k] = filter->sep[n - 1 - k];
+      }
+      if ((tmp = (real_t*)arena_alloc(arena, sizeof(real_t) * halo.x * (halo.y + 2 * r))) &&
+          (acc = (double*)arena_alloc(arena, sizeof(double) * halo.x))) {
+        CPU_SELECT(image_correlate_separable)(out, dst->x, &halo, m, r, tmp, acc);
+        rv = dst;
+      }
+    } else {
+      for (k = 0; k < n; k++) {
+        m[k] = filter->coef[n - 1 - k];
+      }
+      CPU_SELECT(image_correlate)(out, dst->x, &halo, m, r);
+      rv = dst;
+    }
+  }
+  arena_release(arena, mark);
+  if (arena == &local)
+    arena_destroy(&local);
+  return rv;
+}
+
+image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter, arena_t* arena) {
+  return image_convolve_region(dst, src, filter, 1, 0, src->x, 0, src->y, arena);
+}
+
+image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter, arena_t* arena) {
+  return image_convolve_region(dst, src, filter, 0, 0, src->x, 0, src->y, arena);
+}
+
+/* Halve the image, every pixel is the mean of a 2x2 block. */
+image_t* image_downsample(image_t* dst, image_t* src) {
+  int i, j, k, l, n;
+  double sum;
+
+  if (!(image_create(dst, (src->x + 1) / 2, (src->y + 1) / 2)))
+    return NULL;
+  for (j = 0; j < dst->y; j++) {
+    for (i = 0; i < dst->x; i++) {
+      sum = 0.0;
+      n = 0;
+      for (l = 2*j; l < 2*j + 2 && l < src->y; l++) {
+        for (k = 2*i; k < 2*i + 2 && k < src->x; k++) {
+          sum += image_get(src, k, l);
+          n++;
         }
       }
-      image_set(dst, i, j, value);
+      image_set(dst, i, j, sum / n);
+    }
+  }
+  return dst;
+}
+
+/* Bilinear interpolation of the half size image src into dst. */
+image_t* image_upsample(image_t* dst, image_t* src) {
+  int i, j, i0, j0, i1, j1;
+  double fx, fy, v0, v1;
+
+  for (j = 0; j < dst->y; j++) {
+    fy = (j - 0.5) / 2.0;
+    if (fy < 0.0) fy = 0.0;
+    if (fy > src->y - 1) fy = src->y - 1;
+    j0 = (int)fy;
+    j1 = (j0 + 1 < src->y) ? j0 + 1 : j0;
+    fy -= j0;
+    for (i = 0; i < dst->x; i++) {
+      fx = (i - 0.5) / 2.0;
+      if (fx < 0.0) fx = 0.0;
+      if (fx > src->x - 1) fx = src->x - 1;
+      i0 = (int)fx;
+      i1 = (i0 + 1 < src->x) ? i0 + 1 : i0;
+      fx -= i0;
+      v0 = (1.0 - fx) * image_get(src, i0, j0) + fx * image_get(src, i1, j0);
+      v1 = (1.0 - fx) * image_get(src, i0, j1) + fx * image_get(src, i1, j1);
+      image_set(dst, i, j, (1.0 - fy) * v0 + fy * v1);
     }
   }
   return dst;
@@ -99,3 +436,183 @@ double image_get_mirror(image_t* image, int x, int y) {
 double image_get_period(image_t* image, int x, int y) {
   return image->data[boundary_normalize_period(y, image->y) * image->x + boundary_normalize_period(x, image->x)];
 }
+
+/* Halo images */
+
+#define IMAGE_HALO_ALIGN 64 /* bytes */
+
+#define IMAGE_LEVEL(k)    (real_t)((k) / 255.0)
+#define IMAGE_LEVEL4(k)   IMAGE_LEVEL(k), IMAGE_LEVEL((k) + 1), IMAGE_LEVEL((k) + 2), IMAGE_LEVEL((k) + 3)
+#define IMAGE_LEVEL16(k)  IMAGE_LEVEL4(k), IMAGE_LEVEL4((k) + 4), IMAGE_LEVEL4((k) + 8), IMAGE_LEVEL4((k) + 12)
+#define IMAGE_LEVEL64(k)  IMAGE_LEVEL16(k), IMAGE_LEVEL16((k) + 16), IMAGE_LEVEL16((k) + 32), IMAGE_LEVEL16((k) + 48)
+
+/* level/255.0, exactly the values the Hopfield update stores */
+const real_t image_levels[256] = {
+  IMAGE_LEVEL64(0), IMAGE_LEVEL64(64), IMAGE_LEVEL64(128), IMAGE_LEVEL64(192)
+};
+
+static int image_halo_align(int n, int align) {
+  return (n + align - 1) / align * align;
+}
+
+static int image_halo_normalize(image_halo_t* image, int u, int l) {
+  return (image->mirror ? boundary_normalize_mirror(u, l) : boundary_normalize_period(u, l));
+}
+
+static unsigned char image_halo_level(double value) {
+  int level;
+
+  level = (int)(255.0 * value + 0.5);
+  return (unsigned char)(level < 0 ? 0 : (level > 255 ? 255 : level));
+}
+
+/* Allocate pixels of the given size, returns pixel (0,0). Another 64
+ * bytes after the last row keep reads running past a row in bounds.
+ * Pixels from an arena leave mem NULL, image_halo_destroy() skips them. */
+static char* image_halo_alloc(image_halo_t* image, int x, int y, int halo, int mirror, size_t size, arena_t* arena) {
+  int left, align;
+  size_t n;
+  char *base;
+
+  image->x = x;
+  image->y = y;
+  image->halo = halo;
+  image->mirror = mirror;
+  align = IMAGE_HALO_ALIGN / (int)size;
+  left = image_halo_align(halo, align);
+  image->stride = left + image_halo_align(x + halo, align);
+  n = ((size_t)image->stride * (y + 2 * halo) + 2 * align) * size;
+  if (arena) {
+    image->mem = NULL;
+    if (!(base = (char*)arena_alloc(arena, n)))
+      return NULL;
+    memset(base, 0, n);
+    return base + ((size_t)halo * image->stride + left) * size;
+  }
+  if (!(image->mem = calloc(n, 1)))
+    return NULL;
+  /* the first pixel of every row lies on a 64 byte boundary */
+  base = (char*)image->mem + (IMAGE_HALO_ALIGN - (size_t)image->mem % IMAGE_HALO_ALIGN) % IMAGE_HALO_ALIGN;
+  return base + ((size_t)halo * image->stride + left) * size;
+}
+
+image_halo_t* image_halo_create(image_halo_t* image, int x, int y, int halo, int mirror) {
+  image->data8 = NULL;
+  image->data = (real_t*)image_halo_alloc(image, x, y, halo, mirror, sizeof(real_t), NULL);
+  return (image->data ? image : NULL);
+}
+
+image_halo_t* image_halo_create_arena(image_halo_t* image, int x, int y, int halo, int mirror, arena_t* arena) {
+  image->data8 = NULL;
+  image->data = (real_t*)image_halo_alloc(image, x, y, halo, mirror, sizeof(real_t), arena);
+  return (image->data ? image : NULL);
+}
+
+image_halo_t* image_halo_create_quantized(image_halo_t* image, int x, int y, int halo, int mirror) {
+  image->data = NULL;
+  image->data8 = (unsigned char*)image_halo_alloc(image, x, y, halo, mirror, 1, NULL);
+  return (image->data8 ? image : NULL);
+}
+
+void image_halo_destroy(image_halo_t* image) {
+  free(image->mem);
+}
+
+/* Copy src into the interior, quantized if the halo image is, and rebuild
+ * the whole halo. */
+void image_halo_fill(image_halo_t* image, image_t* src) {
+  int i, j, u, v, h;
+  ptrdiff_t st;
+
+  h = image->halo;
+  st = image->stride;
+  for (j = 0; j < image->y; j++) {
+    if (image->data8) {
+      for (i = 0; i < image->x; i++) {
+        image->data8[j * st + i] = image_halo_level(src->data[(size_t)j * src->x + i]);
+      }
+    } else {
+      memcpy(image->data + j * st, src->data + (size_t)j * src->x, sizeof(real_t) * src->x);
+    }
+  }
+  for (j = -h; j < image->y + h; j++) {
+    v = image_halo_normalize(image, j, image->y);
+    for (i = -h; i < image->x + h; i++) {
+      if (j >= 0 && j < image->y && i == 0) i = image->x;
+      u = image_halo_normalize(image, i, image->x);
+      if (image->data8) image->data8[(ptrdiff_t)j * st + i] = image->data8[v * st + u];
+      else image->data[(ptrdiff_t)j * st + i] = image->data[v * st + u];
+    }
+  }
+}
+
+/* Fill the whole halo image, halo included, with the window of src whose
+ * pixel (0,0) is src pixel (i0,j0), under the boundary conditions of the
+ * halo image. Real halo images only. */
+void image_halo_fill_region(image_halo_t* image, image_t* src, int i0, int j0) {
+  int i, j, h, a, b;
+  real_t *row, *s;
+
+  h = image->halo;
+  /* columns [a,b) of the window lie inside src */
+  a = (-i0 > -h ? -i0 : -h);
+  b = (src->x - i0 < image->x + h ? src->x - i0 : image->x + h);
+  for (j = -h; j < image->y + h; j++) {
+    s = src->data + (size_t)image_halo_normalize(image, j0 + j, src->y) * src->x;
+    row = image->data + (ptrdiff_t)j * image->stride;
+    for (i = -h; i < image->x + h; i++) {
+      if (i == a && a < b) {
+        memcpy(row + a, s + i0 + a, sizeof(real_t) * (b - a));
+        i = b - 1;
+      } else {
+        row[i] = s[image_halo_normalize(image, i0 + i, src->x)];
+      }
+    }
+  }
+}
+
+/* Same geometry assumed, copies the interior together with the halo. */
+void image_halo_copy(image_halo_t* dst, image_halo_t* src) {
+  int h;
+  size_t n;
+
+  h = src->halo;
+  n = (size_t)src->stride * (src->y + 2 * h - 1) + src->x + 2 * h;
+  if (src->data8)
+    memcpy(dst->data8 - (size_t)h * dst->stride - h, src->data8 - (size_t)h * src->stride - h, n);
+  else
+    memcpy(dst->data - (size_t)h * dst->stride - h, src->data - (size_t)h * src->stride - h, sizeof(real_t) * n);
+}
+
+/* Set pixel (x,y) and every halo sample which the boundary conditions
+ * map onto it. */
+void image_halo_set(image_halo_t* image, int x, int y, double value) {
+  int x0[3], x1[3], y0[3], y1[3];
+  int a, b, u, v, h;
+  unsigned char level;
+
+  level = image_halo_level(value);
+  if (image->data8) image->data8[(size_t)y * image->stride + x] = level;
+  else image->data[(size_t)y * image->stride + x] = value;
+  h = image->halo;
+  if (x > h && x < image->x - 1 - h && y > h && y < image->y - 1 - h)
+    return;
+
+  /* candidates: the halo before, the pixel itself and the halo after */
+  x0[0] = -h; x1[0] = 0; x0[1] = x; x1[1] = x + 1; x0[2] = image->x; x1[2] = image->x + h;
+  y0[0] = -h; y1[0] = 0; y0[1] = y; y1[1] = y + 1; y0[2] = image->y; y1[2] = image->y + h;
+  for (b = 0; b < 3; b++) {
+    for (v = y0[b]; v < y1[b]; v++) {
+      if (b != 1 && image_halo_normalize(image, v, image->y) != y)
+        continue;
+      for (a = 0; a < 3; a++) {
+        for (u = x0[a]; u < x1[a]; u++) {
+          if (a != 1 && image_halo_normalize(image, u, image->x) != x)
+            continue;
+          if (image->data8) image->data8[(ptrdiff_t)v * image->stride + u] = level;
+          else image->data[(ptrdiff_t)v * image->stride + u] = value;
+        }
+      }
+    }
+  }
+}
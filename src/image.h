@@ -21,27 +21,89 @@
 #include "compiler.h"
 #include "convmask.h"
 #include "boundary.h"
+#include "arena.h"
+#include "fft.h"
 
 C_DECL_BEGIN
 
+/* Pixel loops stream rows in column strips of this width, so the rows
+ * under a filter window stay in cache even on very wide images. */
+#define IMAGE_BLOCK 256
+
+/* Multiply-adds the vector correlation loops do in the time of one FFT
+ * operation, measured about 4, set higher so that the FFT is taken only
+ * where it clearly wins (defocus radius 8 and up on large images). */
+#define IMAGE_FFT_DIRECT 6.0
+
 typedef struct {
   int     x;
   int     y;
-  double *data;
+  real_t *data;
 } image_t;
 
+/* Copy of an image surrounded by a halo of boundary samples, so that
+ * taps up to halo pixels outside need no boundary normalization. Pixel
+ * (x,y) is data[y * stride + x] for -halo <= x,y < x,y + halo; rows
+ * start on 64 byte boundaries and may be read up to 64 bytes past their
+ * right halo. A quantized copy stores 8 bit levels in data8 instead, the
+ * pixel is image_levels[level]. */
+typedef struct {
+  int            x;
+  int            y;
+  int            halo;
+  int            stride;
+  int            mirror;
+  void          *mem;
+  real_t        *data;
+  unsigned char *data8;
+} image_halo_t;
+
+/* Transform plan and spectrum of a correlation mask of radius r, on
+ * overlap-save blocks of n x n pixels. */
+typedef struct {
+  int     n;
+  int     r;
+  fft_t   plan;
+  double *h;
+} image_fft_t;
+
+extern const real_t image_levels[256];
+
+#define image_halo_get(image, i, j) ((image)->data[(ptrdiff_t)(j) * (image)->stride + (i)])
+#define image_halo_get8(image, i, j) ((image)->data8[(ptrdiff_t)(j) * (image)->stride + (i)])
+
 image_t* image_create(image_t* image, int x, int y);
 image_t* image_create_copyparam(image_t* image, image_t* src);
+image_t* image_create_arena(image_t* image, int x, int y, arena_t* arena);
 void image_destroy(image_t* image);
 double image_get(image_t* image, int x, int y);
 void image_set(image_t* image, int x, int y, double value);
 
-image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter);
-image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter);
+image_t* image_correlate(image_t* dst, image_t* src, const double* mask, int r, int mirror, arena_t* arena);
+int image_correlate_fft_size(int x, int y, int r);
+image_fft_t* image_fft_create(image_fft_t* fft, const double* mask, int r, int n);
+void image_fft_destroy(image_fft_t* fft);
+double* image_correlate_fft(double* dst, image_t* src, image_fft_t* fft, int mirror, arena_t* arena);
+image_t* image_convolve_mirror(image_t* dst, image_t* src, convmask_t* filter, arena_t* arena);
+image_t* image_convolve_period(image_t* dst, image_t* src, convmask_t* filter, arena_t* arena);
+image_t* image_convolve_region(image_t* dst, image_t* src, convmask_t* filter, int mirror,
+                               int i0, int i1, int j0, int j1, arena_t* arena);
+
+image_t* image_downsample(image_t* dst, image_t* src);
+image_t* image_upsample(image_t* dst, image_t* src);
 
 double image_get_mirror(image_t* image, int x, int y);
 double image_get_period(image_t* image, int x, int y);
 
+image_halo_t* image_halo_create(image_halo_t* image, int x, int y, int halo, int mirror);
+image_halo_t* image_halo_create_quantized(image_halo_t* image, int x, int y, int halo, int mirror);
+image_halo_t* image_halo_create_arena(image_halo_t* image, int x, int y, int halo, int mirror, arena_t* arena);
+void image_halo_destroy(image_halo_t* image);
+void image_halo_fill(image_halo_t* image, image_t* src);
+void image_halo_fill_region(image_halo_t* image, image_t* src, int i0, int j0);
+void image_halo_copy(image_halo_t* dst, image_halo_t* src);
+void image_halo_set(image_halo_t* image, int x, int y, double value);
+
 C_DECL_END
 
 #endif
@@ -15,96 +15,253 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include "lambda.h"
-
-static void get_variance_mirror(image_t* variance, image_t* img, double* pmin, double* pmax, int winsize) {
-  int i, j, k, l;
-  double sum, sum2;
-  double c;
+#include "cpu.h"
+#include "simd.h"
+
+#define LAMBDA_RESYNC 32
+
+/* Scratch rows of the fused pipeline, winsize columns of halo on both
+ * sides of the filtered rows. */
+typedef struct {
+  real_t  *g;      /* filter taps, turned by 180 degrees */
+  real_t  *pad;    /* image row, r + winsize columns of halo */
+  real_t  *h;      /* ring of 2r+1 image rows filtered along x */
+  real_t  *f;      /* ring of 2winsize+2 filtered rows */
+  real_t **rows;   /* window rows of the current variance row */
+  double  *acc;
+  double  *col;
+  double  *col2;
+} lambda_band_t;
+
+/* One row of local variances over (2*winsize+1)^2 windows from running
+ * box sums: the column sums col[] slide down a row at a time, the window
+ * sums slide right a column at a time, so the cost does not depend on
+ * winsize. rows[1..2winsize+1] are the rows of the window, rows[0] the
+ * row which just left it, all readable winsize columns past both ends;
+ * col and col2 cover -winsize..x+winsize-1. On a resync the sums are
+ * added up afresh, so rounding errors do not pile up over large images,
+ * and the samples are taken relative to a new shift, the mean of the
+ * centre row, which keeps the mean square and the squared mean from
+ * cancelling. */
+ALWAYS_INLINE void get_variance_row(real_t* dst, real_t* const* rows, int x, int winsize, int resync, double* shift,
+                                    double* col, double* col2, double* pmin, double* pmax) {
+  int i, l, n;
+  double sum, sum2, u, v;
   double num_points;
-  double var, minvar, maxvar;
-
-  minvar = 1e20;
-  maxvar = 0.0;
-  num_points = (double)((2*winsize+1)*(2*winsize+1));
-
-  for (i = 0; i < variance->x; i++) {
-    for (j = 0; j < variance->y; j++) {
-      sum = 0.0;
-      sum2 = 0.0;
-      for (k = -winsize; k <= winsize; k++) {
-        for (l = -winsize; l <= winsize; l++) {
-          c = image_get_mirror(img, i+k, j+l);
-          sum += c;
-          sum2 += c*c;
-        }
+  double mean, var, minvar, maxvar;
+  const real_t *a, *b;
+
+  n = 2*winsize+1;
+  num_points = (double)(n*n);
+  if (resync) {
+    sum = 0.0;
+    a = rows[winsize+1];
+    for (i = 0; i < x; i++) {
+      sum += a[i];
+    }
+    *shift = sum / x;
+    for (i = -winsize; i < x + winsize; i++) {
+      col[i] = col2[i] = 0.0;
+    }
+    for (l = 1; l <= n; l++) {
+      a = rows[l];
+      for (i = -winsize; i < x + winsize; i++) {
+        v = a[i] - *shift;
+        col[i] += v;
+        col2[i] += v*v;
       }
-      sum /= num_points;
-      sum2 /= num_points;
-      sum *= sum;
-      var = sum2 - sum;
-      image_set(variance, i, j, var);
-      if (var > maxvar) maxvar = var;
-      if (var < minvar) minvar = var;
+    }
+  } else {
+    a = rows[n];
+    b = rows[0];
+    for (i = -winsize; i < x + winsize; i++) {
+      v = a[i] - *shift;
+      u = b[i] - *shift;
+      col[i] += v - u;
+      col2[i] += v*v - u*u;
     }
   }
-  *pmax = maxvar;
-  *pmin = minvar;
 
-#if defined(NDEBUG)
-  printf("variance %d %d\n", variance->x, variance->y);
-  for (i = 0; i < 5; i++) {
-    for (j = 0; j < 5; j++) {
-      printf("[%d %d %g", i, j, image_get (variance, i, j));
+  minvar = *pmin;
+  maxvar = *pmax;
+  sum = sum2 = 0.0;
+  for (i = 0; i < x; i++) {
+    if (i % LAMBDA_RESYNC == 0) {
+      sum = sum2 = 0.0;
+      for (l = i-winsize; l <= i+winsize; l++) {
+        sum += col[l];
+        sum2 += col2[l];
+      }
+    } else {
+      sum += col[i+winsize] - col[i-winsize-1];
+      sum2 += col2[i+winsize] - col2[i-winsize-1];
     }
-    printf("\n");
+    mean = sum / num_points;
+    var = sum2 / num_points - mean * mean;
+    if (var < 0.0) var = 0.0;
+    dst[i] = var;
+    if (var > maxvar) maxvar = var;
+    if (var < minvar) minvar = var;
   }
-#endif
+  *pmin = minvar;
+  *pmax = maxvar;
 }
 
-static void get_variance_period(image_t* variance, image_t* img, double* pmin, double* pmax, int winsize) {
-  int i, j, k, l;
-  double sum, sum2;
-  double c;
-  double num_points;
-  double var, minvar, maxvar;
+/* Variances of the halo image, dst has its size and its rows lie stride
+ * pixels apart. */
+ALWAYS_INLINE void get_variance_body(real_t* dst, int stride, image_halo_t* img, int winsize, real_t** rows,
+                                     double* col, double* col2) {
+  int j, l;
+  double shift, minvar, maxvar;
 
+  shift = 0.0;
   minvar = 1e20;
   maxvar = 0.0;
-  num_points = (double)((2*winsize+1)*(2*winsize+1));
-
-  for (i = 0; i < variance->x; i++) {
-    for (j = 0; j < variance->y; j++) {
-      sum = 0.0;
-      sum2 = 0.0;
-      for (k = -winsize; k <= winsize; k++) {
-        for (l = -winsize; l <= winsize; l++) {
-          c = image_get_period(img, i+k, j+l);
-          sum += c;
-          sum2 += c*c;
+  for (j = 0; j < img->y; j++) {
+    for (l = (j % LAMBDA_RESYNC == 0 ? 1 : 0); l <= 2*winsize+1; l++) {
+      rows[l] = &image_halo_get(img, 0, j-winsize-1+l);
+    }
+    get_variance_row(dst + (size_t)j * stride, rows, img->x, winsize, j % LAMBDA_RESYNC == 0, &shift, col, col2,
+                     &minvar, &maxvar);
+  }
+}
+
+static void get_variance_generic(real_t* dst, int stride, image_halo_t* img, int winsize, real_t** rows,
+                                 double* col, double* col2) {
+  get_variance_body(dst, stride, img, winsize, rows, col, col2);
+}
+
+CPU_TARGET_AVX2 static void get_variance_avx2(real_t* dst, int stride, image_halo_t* img, int winsize, real_t** rows,
+                                              double* col, double* col2) {
+  get_variance_body(dst, stride, img, winsize, rows, col, col2);
+}
+
+CPU_TARGET_AVX512 static void get_variance_avx512(real_t* dst, int stride, image_halo_t* img, int winsize,
+                                                  real_t** rows, double* col, double* col2) {
+  get_variance_body(dst, stride, img, winsize, rows, col, col2);
+}
+
+/* Variance of img over the rectangle [i0,i1) x [j0,j1) into the same
+ * rectangle of variance. */
+static image_t* get_variance(image_t* variance, image_t* img, int winsize, int mirror,
+                             int i0, int i1, int j0, int j1, arena_t* arena) {
+  image_halo_t halo;
+  real_t **rows;
+  double *col, *col2;
+  image_t* rv;
+  int n, mark;
+
+  mark = arena_mark(arena);
+  rv = NULL;
+  n = i1 - i0 + 2 * winsize;
+  if (image_halo_create_arena(&halo, i1 - i0, j1 - j0, winsize, mirror, arena) &&
+      (rows = (real_t**)arena_alloc(arena, sizeof(real_t*) * (2 * winsize + 2))) &&
+      (col = (double*)arena_alloc(arena, sizeof(double) * n)) &&
+      (col2 = (double*)arena_alloc(arena, sizeof(double) * n))) {
+    image_halo_fill_region(&halo, img, i0, j0);
+    CPU_SELECT(get_variance)(variance->data + (size_t)j0 * variance->x + i0, variance->x, &halo, winsize, rows,
+                             col + winsize, col2 + winsize);
+    rv = variance;
+  }
+  arena_release(arena, mark);
+  return rv;
+}
+
+/* Fused filter and variance for separable filters: every image row is
+ * filtered along x into the ring band->h when it is first needed, 2r+1
+ * of those rows make a filtered row of the ring band->f, and the
+ * variance rows follow winsize rows behind. The image is read once, out
+ * gets the variances with their range, filtered the filtered image if it
+ * is not NULL, nothing else of image size is written. Rows and columns
+ * past the image are filtered from its boundary samples, the same sums
+ * in the same order as image_convolve_region(). */
+ALWAYS_INLINE void lambda_stream_body(image_t* image, int r, int winsize, int mirror, lambda_band_t* band,
+                                      real_t* out, real_t* filtered, double* pmin, double* pmax, int wide) {
+  int i, j, k, l, n, x, xw, hnext, fnext;
+  real_t *pad, *h, *f;
+  const real_t *src;
+  double shift;
+
+  n = 2*r+1;
+  x = image->x;
+  xw = x + 2*winsize;
+  pad = band->pad + r + winsize;
+  hnext = -winsize - r;
+  fnext = -winsize;
+  shift = 0.0;
+  *pmin = 1e20;
+  *pmax = 0.0;
+  for (j = 0; j < image->y; j++) {
+    for (; fnext <= j + winsize; fnext++) {
+      for (; hnext <= fnext + r; hnext++) {
+        src = image->data + (size_t)(mirror ? boundary_normalize_mirror(hnext, image->y) :
+                                              boundary_normalize_period(hnext, image->y)) * x;
+        for (i = -r-winsize; i < x + r + winsize; i++) {
+          if (i == 0) {
+            memcpy(pad, src, sizeof(real_t) * x);
+            i = x - 1;
+          } else {
+            pad[i] = src[mirror ? boundary_normalize_mirror(i, x) : boundary_normalize_period(i, x)];
+          }
+        }
+        h = band->h + (size_t)((hnext + winsize + r) % n) * xw;
+        for (i = 0; i < xw; i++) {
+          if (wide) h[i] = simd_dot_wide(band->g, pad + i - winsize - r, n);
+          else h[i] = simd_dot(band->g, pad + i - winsize - r, n);
         }
       }
-      sum /= num_points;
-      sum2 /= num_points;
-      sum *= sum;
-      var = sum2 - sum;
-      image_set(variance, i, j, var);
-      if (var > maxvar) maxvar = var;
-      if (var < minvar) minvar = var;
+      for (i = 0; i < xw; i++) {
+        band->acc[i] = 0.0;
+      }
+      for (l = 0; l < n; l++) {
+        simd_axpy(band->acc, band->h + (size_t)((fnext + l + winsize) % n) * xw, band->g[l], xw);
+      }
+      f = band->f + (size_t)((fnext + winsize + 1) % (2*winsize+2)) * xw;
+      for (i = 0; i < xw; i++) {
+        f[i] = band->acc[i];
+      }
+      if (filtered && fnext >= 0 && fnext < image->y)
+        memcpy(filtered + (size_t)fnext * x, f + winsize, sizeof(real_t) * x);
+    }
+    for (l = (j % LAMBDA_RESYNC == 0 ? 1 : 0); l <= 2*winsize+1; l++) {
+      k = j - winsize - 1 + l;
+      band->rows[l] = band->f + (size_t)((k + winsize + 1) % (2*winsize+2)) * xw + winsize;
     }
+    get_variance_row(out + (size_t)j * x, band->rows, x, winsize, j % LAMBDA_RESYNC == 0, &shift,
+                     band->col, band->col2, pmin, pmax);
   }
-  *pmax = maxvar;
-  *pmin = minvar;
+}
 
-#if defined(NDEBUG)
-  printf("variance %d %d\n", variance->x, variance->y);
-  for (i = 0; i < 5; i++) {
-    for (j = 0; j < 5; j++) {
-      printf("[%d %d %g", i, j, image_get (variance, i, j));
-    }
-    printf("\n");
+static void lambda_stream_generic(image_t* image, int r, int winsize, int mirror, lambda_band_t* band,
+                                  real_t* out, real_t* filtered, double* pmin, double* pmax) {
+  lambda_stream_body(image, r, winsize, mirror, band, out, filtered, pmin, pmax, 0);
+}
+
+CPU_TARGET_AVX2 static void lambda_stream_avx2(image_t* image, int r, int winsize, int mirror, lambda_band_t* band,
+                                               real_t* out, real_t* filtered, double* pmin, double* pmax) {
+  lambda_stream_body(image, r, winsize, mirror, band, out, filtered, pmin, pmax, 0);
+}
+
+CPU_TARGET_AVX512 static void lambda_stream_avx512(image_t* image, int r, int winsize, int mirror,
+                                                   lambda_band_t* band, real_t* out, real_t* filtered,
+                                                   double* pmin, double* pmax) {
+  lambda_stream_body(image, r, winsize, mirror, band, out, filtered, pmin, pmax, 1);
+}
+
+static void get_range(image_t* variance, double* pmin, double* pmax) {
+  double minvar, maxvar;
+  int i;
+
+  minvar = 1e20;
+  maxvar = 0.0;
+  for (i = 0; i < variance->x * variance->y; i++) {
+    if (variance->data[i] > maxvar) maxvar = variance->data[i];
+    if (variance->data[i] < minvar) minvar = variance->data[i];
   }
-#endif
+  *pmax = maxvar;
+  *pmin = minvar;
 }
 
 lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int winsize, convmask_t* filter) {
@@ -113,7 +270,18 @@ lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int wi
   lambda->minlambda = minlambda;
   lambda->winsize = winsize;
   lambda->filter = filter;
-  if ((lambda->lambda = (double*)calloc(x * y, sizeof(double))))
+  lambda->arena = NULL;
+  lambda->incremental = 0;
+  lambda->valid = 0;
+  lambda->bx = (x + LAMBDA_BLOCK - 1) >> LAMBDA_BLOCK_SHIFT;
+  lambda->by = (y + LAMBDA_BLOCK - 1) >> LAMBDA_BLOCK_SHIFT;
+  lambda->dirty = NULL;
+  lambda->moved = NULL;
+  lambda->moved_all = 1;
+  lambda->minvar = lambda->maxvar = 0.0;
+  lambda->filtered.data = NULL;
+  lambda->variance.data = NULL;
+  if ((lambda->lambda = (real_t*)calloc(x * y, sizeof(real_t))))
     return lambda;
 #if defined(NDEBUG)
     printf("Error, lambda_create() - Out of memory!\n");
@@ -123,6 +291,10 @@ lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int wi
 
 void lambda_destroy(lambda_t* lambda) {
   free(lambda->lambda);
+  free(lambda->dirty);
+  free(lambda->moved);
+  free(lambda->filtered.data);
+  free(lambda->variance.data);
 }
 
 void lambda_set_mirror(lambda_t* lambda, int mirror) {
@@ -133,200 +305,330 @@ void lambda_set_nl(lambda_t* lambda, int nl) {
   lambda->nl = nl;
 }
 
-static lambda_t* lambda_calculate_period(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
-  double akoef, bkoef;
-  int i, size;
+/* Scratch images of lambda_calculate() come from arena, NULL allocates
+ * them on every call. */
+void lambda_set_arena(lambda_t* lambda, arena_t* arena) {
+  lambda->arena = arena;
+}
 
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_period(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
+/* Recompute only around the pixels marked in dirty since the previous
+ * lambda_calculate(), whoever changes the image marks them. */
+void lambda_set_incremental(lambda_t* lambda, int incremental) {
+  lambda->incremental = incremental;
+}
+
+/* The image was changed without marking the pixels. */
+void lambda_invalidate(lambda_t* lambda) {
+  lambda->valid = 0;
+}
+
+/* Whether the last lambda_calculate() may have changed lambda at a pixel
+ * of i0..i1-1 x j0..j1-1, which may reach past the image as far as the
+ * boundary conditions fold it back. */
+int lambda_moved(lambda_t* lambda, int i0, int i1, int j0, int j1) {
+  int i, j, u, v, pu, pv;
+
+  if (lambda->moved_all || !lambda->moved)
+    return 1;
+  pv = -1;
+  for (j = j0; j < j1; j++) {
+    v = (lambda->mirror ? boundary_normalize_mirror(j, lambda->y) : boundary_normalize_period(j, lambda->y));
+    v >>= LAMBDA_BLOCK_SHIFT;
+    if (v == pv)
+      continue;
+    pv = v;
+    pu = -1;
+    for (i = i0; i < i1; i++) {
+      u = (lambda->mirror ? boundary_normalize_mirror(i, lambda->x) : boundary_normalize_period(i, lambda->x));
+      u >>= LAMBDA_BLOCK_SHIFT;
+      if (u == pu)
+        continue;
+      pu = u;
+      if (lambda->moved[v * lambda->bx + u])
+        return 1;
     }
-  } else {
-    imgcal = image;
   }
+  return 0;
+}
 
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh)
-      image_destroy(imgcal);
-    return NULL;
+/* Variances of the whole image with lambda_stream_body(). */
+static int lambda_stream(lambda_t* lambda, image_t* image, real_t* out, real_t* filtered, double* pmin, double* pmax,
+                         arena_t* arena) {
+  lambda_band_t band;
+  int k, n, r, w, xw;
+
+  r = (lambda->filter ? lambda->filter->radius : 0);
+  w = lambda->winsize;
+  n = 2 * r + 1;
+  xw = image->x + 2 * w;
+  if (!((band.g = (real_t*)arena_alloc(arena, sizeof(real_t) * n)) &&
+        (band.pad = (real_t*)arena_alloc(arena, sizeof(real_t) * (xw + 2 * r))) &&
+        (band.h = (real_t*)arena_alloc(arena, sizeof(real_t) * n * xw)) &&
+        (band.f = (real_t*)arena_alloc(arena, sizeof(real_t) * (2 * w + 2) * xw)) &&
+        (band.rows = (real_t**)arena_alloc(arena, sizeof(real_t*) * (2 * w + 2))) &&
+        (band.acc = (double*)arena_alloc(arena, sizeof(double) * xw)) &&
+        (band.col = (double*)arena_alloc(arena, sizeof(double) * xw)) &&
+        (band.col2 = (double*)arena_alloc(arena, sizeof(double) * xw))))
+    return 0;
+  /* no filter passes the image through with the single tap 1.0 */
+  for (k = 0; k < n; k++) {
+    band.g[k] = (lambda->filter ? lambda->filter->sep[n - 1 - k] : 1.0);
   }
+  band.col += w;
+  band.col2 += w;
+  CPU_SELECT(lambda_stream)(image, r, w, lambda->mirror, &band, out, filtered, pmin, pmax);
+  return 1;
+}
 
-  get_variance_period(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
+/* Local variance of the whole image with its range, filtered first if
+ * there is a filter. Separable filters take the fused pipeline, which
+ * needs filtered only if it should be kept, others go through filtered. */
+static image_t* lambda_variance(lambda_t* lambda, image_t* image, image_t* filtered, image_t* variance,
+                                double* pmin, double* pmax, arena_t* arena) {
+  if (!lambda->filter || lambda->filter->sep)
+    return (lambda_stream(lambda, image, variance->data, filtered->data, pmin, pmax, arena) ? variance : NULL);
+  if (!(image_convolve_region(filtered, image, lambda->filter, lambda->mirror, 0, image->x, 0, image->y, arena)))
+    return NULL;
+  if (!(get_variance(variance, filtered, lambda->winsize, lambda->mirror, 0, image->x, 0, image->y, arena)))
+    return NULL;
+  get_range(variance, pmin, pmax);
+  return variance;
+}
 
-  bkoef = (1.0 - lambda->minlambda)/(maxvar - minvar);
-  akoef = 1.0 - (minvar*(1.0 - lambda->minlambda))/(maxvar - minvar);
+/* Blocks a change reaches through r pixels along an axis of l pixels. A
+ * partial last block shortens the distance across a periodic boundary. */
+static int lambda_reach(lambda_t* lambda, int r, int l) {
+  return (r + LAMBDA_BLOCK - 1) / LAMBDA_BLOCK + (!lambda->mirror && l % LAMBDA_BLOCK ? 1 : 0);
+}
 
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = akoef + bkoef * variance.data[i];
+/* Mark in out the blocks within dx, dy blocks of a block marked in in. */
+static void lambda_dilate(lambda_t* lambda, unsigned char* out, const unsigned char* in, int dx, int dy) {
+  int i, j, k, l, u, v;
+
+  memset(out, 0, (size_t)lambda->bx * lambda->by);
+  for (j = 0; j < lambda->by; j++) {
+    for (i = 0; i < lambda->bx; i++) {
+      if (!in[j * lambda->bx + i])
+        continue;
+      for (l = -dy; l <= dy; l++) {
+        for (k = -dx; k <= dx; k++) {
+          u = i + k;
+          v = j + l;
+          if (lambda->mirror) {
+            if (u < 0 || u >= lambda->bx || v < 0 || v >= lambda->by)
+              continue;
+          } else {
+            u = boundary_normalize_period(u, lambda->bx);
+            v = boundary_normalize_period(v, lambda->by);
+          }
+          out[v * lambda->bx + u] = 1;
+        }
+      }
+    }
   }
+}
 
-#if defined(NDEBUG)
-  printf("lambda_calculate_period(), minvar=%g maxvar=%g bkoef=%g akoef=%g size=%d\n",
-         minvar, maxvar, bkoef, akoef, size);
-#endif
-
-  if (lambda->filter) {
-    image_destroy(imgcal);
+/* Refilter (filter set) or recompute the variance in the marked blocks
+ * of mask, one rectangle per run of blocks in a row of blocks. */
+static lambda_t* lambda_update_blocks(lambda_t* lambda, image_t* image, const unsigned char* mask, int filter,
+                                      arena_t* arena) {
+  int i, j, k, i0, i1, j0, j1;
+
+  for (j = 0; j < lambda->by; j++) {
+    j0 = j * LAMBDA_BLOCK;
+    j1 = (j0 + LAMBDA_BLOCK < lambda->y ? j0 + LAMBDA_BLOCK : lambda->y);
+    /* blocks i..k-1 are marked, block k is not */
+    for (i = 0; i < lambda->bx; i = k + 1) {
+      for (k = i; k < lambda->bx && mask[j * lambda->bx + k]; k++) {
+      }
+      if (k == i)
+        continue;
+      i0 = i * LAMBDA_BLOCK;
+      i1 = (k * LAMBDA_BLOCK < lambda->x ? k * LAMBDA_BLOCK : lambda->x);
+      if (filter) {
+        if (!(image_convolve_region(&(lambda->filtered), image, lambda->filter, lambda->mirror, i0, i1, j0, j1, arena)))
+          return NULL;
+      } else if (!(get_variance(&(lambda->variance), (lambda->filter ? &(lambda->filtered) : image), lambda->winsize,
+                                lambda->mirror, i0, i1, j0, j1, arena))) {
+        return NULL;
+      }
+    }
   }
-  image_destroy(&variance);
-
   return lambda;
 }
 
-static lambda_t* lambda_calculate_period_nl(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
-  double alpha;
-  int i, size;
-
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
+/* Incremental variance: a change of the image reaches the filtered image
+ * within the filter radius and the variance winsize pixels further. Only
+ * those blocks are recomputed, unless it is the first call, the image was
+ * invalidated or more than half of the blocks would be, then all are. */
+static image_t* lambda_update(lambda_t* lambda, image_t* image, double* pmin, double* pmax, arena_t* arena) {
+  unsigned char *near;
+  int k, n, count;
+
+  n = lambda->bx * lambda->by;
+  near = NULL;
+  if (!lambda->dirty) {
+    if (!(lambda->variance.data || image_create(&(lambda->variance), lambda->x, lambda->y)))
       return NULL;
-    if (!(image_convolve_period(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
+    if (lambda->filter && !(lambda->filtered.data || image_create(&(lambda->filtered), lambda->x, lambda->y)))
       return NULL;
-    }
-  } else {
-    imgcal = image;
+    if (!(lambda->dirty = (unsigned char*)calloc(n, 1)))
+      return NULL;
+    if (!(lambda->moved = (unsigned char*)calloc(n, 1)))
+      return NULL;
+    lambda->valid = 0;
   }
 
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh)
-      image_destroy(imgcal);
-    return NULL;
+  count = n;
+  if (lambda->valid) {
+    if (!(near = (unsigned char*)arena_alloc(arena, n)))
+      return NULL;
+    if (lambda->filter)
+      lambda_dilate(lambda, near, lambda->dirty, lambda_reach(lambda, lambda->filter->radius, lambda->x),
+                    lambda_reach(lambda, lambda->filter->radius, lambda->y));
+    else
+      memcpy(near, lambda->dirty, n);
+    lambda_dilate(lambda, lambda->moved, near, lambda_reach(lambda, lambda->winsize, lambda->x),
+                  lambda_reach(lambda, lambda->winsize, lambda->y));
+    count = 0;
+    for (k = 0; k < n; k++) {
+      count += lambda->moved[k];
+    }
   }
 
-  get_variance_period(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
-  alpha = (1.0 - lambda->minlambda)/(lambda->minlambda * (maxvar - minvar));
-
-  size = lambda->x * lambda->y;
-  for (i = 0; i < size; i++) {
-    lambda->lambda[i] = 1.0/(1.0 + alpha * (variance.data[i] - minvar));
+  /* a failure half way leaves the planes behind the image */
+  lambda->valid = 0;
+  lambda->moved_all = (2 * count > n);
+  if (2 * count > n) {
+    if (!(lambda_variance(lambda, image, &(lambda->filtered), &(lambda->variance), pmin, pmax, arena)))
+      return NULL;
+  } else {
+    if (count > 0 && lambda->filter && !(lambda_update_blocks(lambda, image, near, 1, arena)))
+      return NULL;
+    if (count > 0 && !(lambda_update_blocks(lambda, image, lambda->moved, 0, arena)))
+      return NULL;
+    get_range(&(lambda->variance), pmin, pmax);
   }
+  memset(lambda->dirty, 0, n);
+  lambda->valid = 1;
 
 #if defined(NDEBUG)
-  printf("lambda_calculate_period_nl(), minvar=%g maxvar=%g alpha=%g size=%d\n",
-         minvar, maxvar, alpha, size);
+  printf("lambda_update(), blocks=%d of %d\n", count, n);
 #endif
-
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
-  return lambda;
+  return &(lambda->variance);
 }
 
-static lambda_t* lambda_calculate_mirror(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
+/* lambda falls linearly from 1 at the lowest variance to minlambda at
+ * the highest. */
+static lambda_t* lambda_calculate_linear(lambda_t* lambda, image_t* variance, double minvar, double maxvar) {
   double akoef, bkoef;
   int i, size;
 
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_mirror(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
-    }
-  } else {
-    imgcal = image;
-  }
-
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh)
-      image_destroy(imgcal);
-    return NULL;
-  }
-
-  get_variance_mirror(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
   bkoef = (1.0 - lambda->minlambda)/(maxvar - minvar);
   akoef = 1.0 - (minvar*(1.0 - lambda->minlambda))/(maxvar - minvar);
 
   size = lambda->x * lambda->y;
   for (i = 0; i < size; i++) {
-    lambda->lambda[i] = akoef + bkoef * variance.data[i];
+    lambda->lambda[i] = akoef + bkoef * variance->data[i];
   }
 
 #if defined(NDEBUG)
-  printf("lambda_calculate_mirror(), minvar=%g maxvar=%g bkoef=%g akoef=%g size=%d\n",
-         minvar, maxvar, bkoef, akoef, size);
+  printf("lambda_calculate_%s(), minvar=%g maxvar=%g bkoef=%g akoef=%g size=%d\n",
+         (lambda->mirror ? "mirror" : "period"), minvar, maxvar, bkoef, akoef, size);
 #endif
 
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
   return lambda;
 }
 
-static lambda_t* lambda_calculate_mirror_nl(lambda_t* lambda, image_t* image) {
-  image_t imgenh, *imgcal;
-  image_t variance;
-  double minvar, maxvar;
+static lambda_t* lambda_calculate_nl(lambda_t* lambda, image_t* variance, double minvar, double maxvar) {
   double alpha;
   int i, size;
 
-  if (lambda->filter) {
-    if (!(imgcal = image_create_copyparam(&imgenh, image)))
-      return NULL;
-    if (!(image_convolve_mirror(imgcal, image, lambda->filter))) {
-      image_destroy(imgcal);
-      return NULL;
-    }
-  } else {
-    imgcal = image;
-  }
-
-  if (!(image_create_copyparam(&variance, imgcal))) {
-    if (imgcal == &imgenh)
-      image_destroy(imgcal);
-    return NULL;
-  }
-
-  get_variance_mirror(&variance, imgcal, &minvar, &maxvar, lambda->winsize);
-
-  alpha = (1.0 - lambda->minlambda)/(lambda->minlambda*(maxvar - minvar));
+  alpha = (1.0 - lambda->minlambda)/(lambda->minlambda * (maxvar - minvar));
 
   size = lambda->x * lambda->y;
   for (i = 0; i < size; i++) {
-    lambda->lambda[i] = 1.0/(1.0 + alpha * (variance.data[i] - minvar));
+    lambda->lambda[i] = 1.0/(1.0 + alpha * (variance->data[i] - minvar));
   }
 
 #if defined(NDEBUG)
-  printf("lambda_calculate_mirror_nl(), minvar=%g maxvar=%g alpha=%g size=%d\n",
-         minvar, maxvar, alpha, size);
+  printf("lambda_calculate_%s_nl(), minvar=%g maxvar=%g alpha=%g size=%d\n",
+         (lambda->mirror ? "mirror" : "period"), minvar, maxvar, alpha, size);
 #endif
 
-  if (lambda->filter) {
-    image_destroy(imgcal);
-  }
-  image_destroy(&variance);
-
   return lambda;
 }
 
+/* Without incremental the variances are written over lambda and mapped
+ * in place, so the only image size scratch is the filtered image of a
+ * filter which is not separable. */
+static lambda_t* lambda_calculate_arena(lambda_t* lambda, image_t* image, arena_t* arena) {
+  image_t filtered, *variance, scratch;
+  double minvar, maxvar;
+
+  variance = NULL;
+  scratch.x = image->x;
+  scratch.y = image->y;
+  scratch.data = lambda->lambda;
+  filtered.data = NULL;
+  if (lambda->incremental)
+    variance = lambda_update(lambda, image, &minvar, &maxvar, arena);
+  else if (!lambda->filter || lambda->filter->sep || image_create_arena(&filtered, image->x, image->y, arena))
+    variance = lambda_variance(lambda, image, &filtered, &scratch, &minvar, &maxvar, arena);
+  if (!variance)
+    return NULL;
+  /* lambda is normalised by the variance range, moving it moves all */
+  if (!lambda->incremental || minvar != lambda->minvar || maxvar != lambda->maxvar)
+    lambda->moved_all = 1;
+  lambda->minvar = minvar;
+  lambda->maxvar = maxvar;
+  if (lambda->nl) return lambda_calculate_nl(lambda, variance, minvar, maxvar);
+  return lambda_calculate_linear(lambda, variance, minvar, maxvar);
+}
+
 lambda_t* lambda_calculate(lambda_t* lambda, image_t* image) {
-  if (lambda->mirror) {
-    if (lambda->nl) return lambda_calculate_mirror_nl(lambda, image);
-    else return lambda_calculate_mirror(lambda, image);
-  } else {
-    if (lambda->nl) return lambda_calculate_period_nl(lambda, image);
-    else return lambda_calculate_period(lambda, image);
+  arena_t local, *arena;
+  lambda_t* rv;
+  int mark;
+
+  arena = (lambda->arena ? lambda->arena : arena_create(&local));
+  mark = arena_mark(arena);
+  rv = lambda_calculate_arena(lambda, image, arena);
+  arena_release(arena, mark);
+  if (arena == &local)
+    arena_destroy(&local);
+  return rv;
+}
+
+/* One lambda for all three channels of an RGB image, calculated from the
+ * luminance of the linear channels or from the largest of them at every
+ * pixel. Incremental lambda needs every channel to mark its changes. */
+lambda_t* lambda_calculate_rgb(lambda_t* lambda, image_t* red, image_t* green, image_t* blue, int mode) {
+  image_t guide;
+  arena_t local, *arena;
+  lambda_t* rv;
+  double v;
+  int i, size, mark;
+
+  arena = (lambda->arena ? lambda->arena : arena_create(&local));
+  mark = arena_mark(arena);
+  rv = NULL;
+  if (image_create_arena(&guide, red->x, red->y, arena)) {
+    size = red->x * red->y;
+    for (i = 0; i < size; i++) {
+      if (mode == LAMBDA_RGB_MAX) {
+        v = (red->data[i] > green->data[i] ? red->data[i] : green->data[i]);
+        guide.data[i] = (real_t)(blue->data[i] > v ? blue->data[i] : v);
+      } else {
+        guide.data[i] = (real_t)(0.2126 * red->data[i] + 0.7152 * green->data[i] + 0.0722 * blue->data[i]);
+      }
+    }
+    rv = lambda_calculate_arena(lambda, &guide, arena);
   }
+  arena_release(arena, mark);
+  if (arena == &local)
+    arena_destroy(&local);
+  return rv;
 }
 
 double lambda_get_mirror(lambda_t* lambda, int x, int y) {
@@ -22,27 +22,60 @@
 #include "convmask.h"
 #include "image.h"
 #include "boundary.h"
+#include "arena.h"
 
 C_DECL_BEGIN
 
+/* Incremental updates recompute lambda in square blocks of pixels */
+#define LAMBDA_BLOCK_SHIFT 4
+#define LAMBDA_BLOCK       (1 << LAMBDA_BLOCK_SHIFT)
+
+/* Channel reduction of lambda_calculate_rgb() */
+#define LAMBDA_RGB_LUMINANCE 1
+#define LAMBDA_RGB_MAX       2
+
+/* With incremental set, lambda_calculate() keeps the filtered image and
+ * the variance and recomputes them only around the blocks marked in
+ * dirty, bx x by of them, since the previous call. valid is cleared when
+ * they no longer match the image. moved marks the blocks in which the
+ * last call may have changed lambda, moved_all all of them, which a
+ * change of the variance range minvar..maxvar sets as well. */
 typedef struct {
   convmask_t *filter;
   int         x;
   int         y;
   int         winsize;
   double      minlambda;
-  double     *lambda;
+  real_t     *lambda;
   int         mirror;
   int         nl;
+  arena_t    *arena;
+  int         incremental;
+  int         valid;
+  int         bx, by;
+  unsigned char *dirty;
+  unsigned char *moved;
+  int         moved_all;
+  double      minvar, maxvar;
+  image_t     filtered;
+  image_t     variance;
 } lambda_t;
 
+/* Block of pixel (i,j) in dirty */
+#define lambda_block(lambda, i, j) (((j) >> LAMBDA_BLOCK_SHIFT) * (lambda)->bx + ((i) >> LAMBDA_BLOCK_SHIFT))
+
 lambda_t* lambda_create(lambda_t* lambda, int x, int y, double minlambda, int winsize, convmask_t* filter);
 void lambda_destroy(lambda_t* lambda);
 
 lambda_t* lambda_calculate(lambda_t* lambda, image_t* image);
+lambda_t* lambda_calculate_rgb(lambda_t* lambda, image_t* red, image_t* green, image_t* blue, int mode);
 
 void lambda_set_mirror(lambda_t* lambda, int mirror);
 void lambda_set_nl(lambda_t* lambda, int nl);
+void lambda_set_arena(lambda_t* lambda, arena_t* arena);
+void lambda_set_incremental(lambda_t* lambda, int incremental);
+void lambda_invalidate(lambda_t* lambda);
+int lambda_moved(lambda_t* lambda, int i0, int i1, int j0, int j1);
 
 double lambda_get_mirror(lambda_t* lambda, int x, int y);
 double lambda_get_period(lambda_t* lambda, int x, int y);
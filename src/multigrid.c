@@ -0,0 +1,148 @@
+/*
+ * Coarse-to-fine Hopfield solver for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "multigrid.h"
+
+/* coarse levels smaller than this are not worth solving */
+#define MULTIGRID_MIN_SIZE 16
+
+#ifndef max
+#define max(x,y) (((x) >= (y))?(x):(y))
+#endif
+
+static double multigrid_time(void) {
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void multigrid_set_levels(multigrid_t* multigrid, int levels, int iterations) {
+  multigrid->levels = (levels < MULTIGRID_MAX_LEVELS) ? levels : MULTIGRID_MAX_LEVELS;
+  multigrid->iterations = iterations;
+}
+
+/* Solve the problem of the (already created) full resolution hopfield on
+ * a pyramid of halved images and blur masks, coarsest first. Each level
+ * starts from the upsampled solution of the level below, and the last one
+ * becomes the initial state of hopfield->image. Coarse levels use the
+ * constant smoothing of hopfield->lambda. */
+multigrid_t* multigrid_solve(multigrid_t* multigrid, hopfield_t* hopfield, convmask_t* convmask) {
+  image_t    observed[MULTIGRID_MAX_LEVELS + 1];
+  convmask_t mask[MULTIGRID_MAX_LEVELS + 1];
+  image_t    state, prev;
+  hopfield_t coarse;
+  multigrid_level_t* level;
+  int n, l, i;
+  double t;
+
+  multigrid->solved = 0;
+  observed[0] = *(hopfield->image);
+  mask[0] = *convmask;
+
+  /* build the pyramid of observed images and blur masks */
+  for (n = 0; n < multigrid->levels; n++) {
+    if ((observed[n].x + 1) / 2 < max(MULTIGRID_MIN_SIZE, 4 * mask[n].radius + 2) ||
+        (observed[n].y + 1) / 2 < max(MULTIGRID_MIN_SIZE, 4 * mask[n].radius + 2))
+      break;
+    if (!(image_downsample(&observed[n+1], &observed[n])))
+      goto multigrid_solve_err0;
+    if (!(convmask_downsample(&mask[n+1], &mask[n]))) {
+      image_destroy(&observed[n+1]);
+      goto multigrid_solve_err0;
+    }
+  }
+
+  for (l = n; l > 0; l--) {
+    if (!(image_create_copyparam(&state, &observed[l])))
+      goto multigrid_solve_err1;
+    memcpy(state.data, observed[l].data, sizeof(real_t) * state.x * state.y);
+
+    /* the threshold is taken from the observed image at creation, the
+     * weights from the halved mask, and so is the damping bound unless
+     * the caller set a damping */
+    coarse = *hopfield;
+    hopfield_set_weights(&coarse, NULL);
+    if (!(hopfield_create(&coarse, &mask[l], &state, NULL))) {
+      image_destroy(&state);
+      goto multigrid_solve_err1;
+    }
+    if (l < n) {
+      image_upsample(&state, &prev);
+      image_destroy(&prev);
+      hopfield_refresh(&coarse);
+    }
+
+    level = &(multigrid->level[multigrid->solved++]);
+    level->x = state.x;
+    level->y = state.y;
+    level->iterations = multigrid->iterations;
+    level->energy = 0.0;
+    t = multigrid_time();
+    for (i = 0; i < multigrid->iterations; i++) {
+      level->energy += hopfield_iteration(&coarse);
+    }
+    level->time = multigrid_time() - t;
+
+    hopfield_destroy(&coarse);
+    prev = state;
+  }
+
+  if (n > 0) {
+    image_upsample(hopfield->image, &prev);
+    image_destroy(&prev);
+    hopfield_refresh(hopfield);
+  }
+
+  for (l = 1; l <= n; l++) {
+    image_destroy(&observed[l]);
+    convmask_destroy(&mask[l]);
+  }
+  return multigrid;
+
+multigrid_solve_err1:
+  if (l < n)
+    image_destroy(&prev);
+multigrid_solve_err0:
+  for (l = 1; l <= n; l++) {
+    image_destroy(&observed[l]);
+    convmask_destroy(&mask[l]);
+  }
+#if defined(NDEBUG)
+  printf("Error, multigrid_solve() - Out of memory!\n");
+#endif
+  return NULL;
+}
+
+/* Size, sweeps, energy and wall time of every level of the last
+ * multigrid_solve(), coarsest first. */
+void multigrid_print(multigrid_t* multigrid, char* str) {
+  int l;
+
+  printf("MULTIGRID=%s: levels=%d\n", str, multigrid->solved);
+  for (l = 0; l < multigrid->solved; l++) {
+    printf(" level %dx%d: iterations=%d energy=%g time=%.3fs\n",
+           multigrid->level[l].x, multigrid->level[l].y, multigrid->level[l].iterations,
+           multigrid->level[l].energy, multigrid->level[l].time);
+  }
+}
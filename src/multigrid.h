@@ -0,0 +1,52 @@
+/*
+ * Coarse-to-fine Hopfield solver for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MULTIGRID_H
+#define _MULTIGRID_H
+
+#include "compiler.h"
+#include "convmask.h"
+#include "image.h"
+#include "hopfield.h"
+
+C_DECL_BEGIN
+
+#define MULTIGRID_MAX_LEVELS 8
+
+typedef struct {
+  int     x;
+  int     y;
+  int     iterations;
+  double  energy;
+  double  time;
+} multigrid_level_t;
+
+typedef struct {
+  int     levels;
+  int     iterations;
+  int     solved;
+  multigrid_level_t level[MULTIGRID_MAX_LEVELS + 1];
+} multigrid_t;
+
+void multigrid_set_levels(multigrid_t* multigrid, int levels, int iterations);
+multigrid_t* multigrid_solve(multigrid_t* multigrid, hopfield_t* hopfield, convmask_t* convmask);
+
+void multigrid_print(multigrid_t* multigrid, char* str);
+
+C_DECL_END
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * Vector row primitives for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <string.h>
+#include "compiler.h"
+
+/* Two accumulators of four lanes of GCC vector extensions, lowered to the
+ * instruction set of the kernel they are inlined into (see cpu.h). The
+ * lanes and the order of the sums are the same on every instruction set,
+ * so are the results. Other compilers, or NO_SIMD, get the scalar loops.
+ * Rows are real_t, loads widen them to double and all arithmetic is done
+ * in double. */
+#if defined(__GNUC__) && !defined(NO_SIMD)
+#define SIMD 1
+typedef double simd_v4_t __attribute__((vector_size(32)));
+typedef double simd_v8_t __attribute__((vector_size(64)));
+typedef real_t simd_r4_t __attribute__((vector_size(4 * sizeof(real_t))));
+typedef real_t simd_r8_t __attribute__((vector_size(8 * sizeof(real_t))));
+#define simd_sum4(a) (((a)[0] + (a)[1]) + ((a)[2] + (a)[3]))
+
+/* Vectors are passed by pointer, by value they would depend on the ABI. */
+ALWAYS_INLINE void simd_load4(simd_v4_t* a, const real_t* p) {
+  simd_r4_t r;
+
+  memcpy(&r, p, sizeof(r));
+  *a = __builtin_convertvector(r, simd_v4_t);
+}
+
+ALWAYS_INLINE void simd_load8(simd_v8_t* a, const real_t* p) {
+  simd_r8_t r;
+
+  memcpy(&r, p, sizeof(r));
+  *a = __builtin_convertvector(r, simd_v8_t);
+}
+#else
+#define SIMD 0
+#endif
+
+/* Sum of w[p]*v[p] for p = 0..n-1. */
+#if SIMD && defined(USE_FLOAT)
+/* Float rows: eight float lanes make one row sum, the rows of a window
+ * are then added up in double by the caller. */
+ALWAYS_INLINE double simd_dot(const real_t* w, const real_t* v, int n) {
+  int p;
+  double s;
+  simd_r8_t acc = {0.0f}, a, b;
+  simd_r4_t lo, hi, c, d;
+
+  for (p = 0; p + 8 <= n; p += 8) {
+    memcpy(&a, w + p, sizeof(a));
+    memcpy(&b, v + p, sizeof(b));
+    acc += a * b;
+  }
+  memcpy(&lo, &acc, sizeof(lo));
+  memcpy(&hi, (char*)&acc + sizeof(lo), sizeof(hi));
+  lo += hi;
+  if (p + 4 <= n) {
+    memcpy(&c, w + p, sizeof(c));
+    memcpy(&d, v + p, sizeof(d));
+    lo += c * d;
+    p += 4;
+  }
+  s = ((double)lo[0] + lo[1]) + ((double)lo[2] + lo[3]);
+  for (; p < n; p++) {
+    s += (double)w[p] * v[p];
+  }
+  return s;
+}
+#else
+ALWAYS_INLINE double simd_dot(const real_t* w, const real_t* v, int n) {
+  int p;
+  double s;
+#if SIMD
+  simd_v4_t acc0 = {0.0, 0.0, 0.0, 0.0}, acc1 = acc0, a, b;
+
+  for (p = 0; p + 8 <= n; p += 8) {
+    simd_load4(&a, w + p);
+    simd_load4(&b, v + p);
+    acc0 += a * b;
+    simd_load4(&a, w + p + 4);
+    simd_load4(&b, v + p + 4);
+    acc1 += a * b;
+  }
+  if (p + 4 <= n) {
+    simd_load4(&a, w + p);
+    simd_load4(&b, v + p);
+    acc0 += a * b;
+    p += 4;
+  }
+  acc0 += acc1;
+  s = simd_sum4(acc0);
+#else
+  p = 0;
+  s = 0.0;
+#endif
+  for (; p < n; p++) {
+    s += (double)w[p] * v[p];
+  }
+  return s;
+}
+#endif
+
+/* simd_dot() with both accumulators in one register of eight lanes, the
+ * same sums in the same order. Only for AVX-512 kernels, GCC spills wider
+ * vectors than the target has to the stack. */
+ALWAYS_INLINE double simd_dot_wide(const real_t* w, const real_t* v, int n) {
+#if SIMD && !defined(USE_FLOAT)
+  int p;
+  double s;
+  simd_v8_t acc = {0.0}, a, b;
+  simd_v4_t lo, hi, c, d;
+
+  for (p = 0; p + 8 <= n; p += 8) {
+    simd_load8(&a, w + p);
+    simd_load8(&b, v + p);
+    acc += a * b;
+  }
+  lo = (simd_v4_t){acc[0], acc[1], acc[2], acc[3]};
+  hi = (simd_v4_t){acc[4], acc[5], acc[6], acc[7]};
+  if (p + 4 <= n) {
+    simd_load4(&c, w + p);
+    simd_load4(&d, v + p);
+    lo += c * d;
+    p += 4;
+  }
+  lo += hi;
+  s = simd_sum4(lo);
+  for (; p < n; p++) {
+    s += (double)w[p] * v[p];
+  }
+  return s;
+#else
+  return simd_dot(w, v, n);
+#endif
+}
+
+/* Sum of w[p]*levels[q[p]] for p = 0..n-1, the levels gathered into the
+ * lanes of the double simd_dot(), so that a quantized state gives the
+ * same sums as the same state stored in double. */
+ALWAYS_INLINE double simd_dot_levels(const real_t* w, const unsigned char* q, const real_t* levels, int n) {
+  int p;
+  double s;
+#if SIMD
+  simd_v4_t acc0 = {0.0, 0.0, 0.0, 0.0}, acc1 = acc0, a, b;
+
+  for (p = 0; p + 8 <= n; p += 8) {
+    simd_load4(&a, w + p);
+    b = (simd_v4_t){levels[q[p]], levels[q[p + 1]], levels[q[p + 2]], levels[q[p + 3]]};
+    acc0 += a * b;
+    simd_load4(&a, w + p + 4);
+    b = (simd_v4_t){levels[q[p + 4]], levels[q[p + 5]], levels[q[p + 6]], levels[q[p + 7]]};
+    acc1 += a * b;
+  }
+  if (p + 4 <= n) {
+    simd_load4(&a, w + p);
+    b = (simd_v4_t){levels[q[p]], levels[q[p + 1]], levels[q[p + 2]], levels[q[p + 3]]};
+    acc0 += a * b;
+    p += 4;
+  }
+  acc0 += acc1;
+  s = simd_sum4(acc0);
+#else
+  p = 0;
+  s = 0.0;
+#endif
+  for (; p < n; p++) {
+    s += (double)w[p] * levels[q[p]];
+  }
+  return s;
+}
+
+/* Sum of w[p]*q[p] for p = 0..n-1 in int32, the caller keeps it from
+ * overflowing. Loops over blocks of 32 and 16 are what GCC turns into
+ * packed multiply-adds of 16 bit lanes (pmaddwd) at -O2, so n should be
+ * a multiple of 16; integer sums do not depend on their order. */
+ALWAYS_INLINE int simd_dot_fixed(const short* w, const unsigned char* q, int n) {
+  int p, k, s;
+
+  s = 0;
+  for (p = 0; p + 32 <= n; p += 32) {
+    for (k = 0; k < 32; k++) {
+      s += w[p + k] * (short)q[p + k];
+    }
+  }
+  for (; p + 16 <= n; p += 16) {
+    for (k = 0; k < 16; k++) {
+      s += w[p + k] * (short)q[p + k];
+    }
+  }
+  for (; p < n; p++) {
+    s += w[p] * q[p];
+  }
+  return s;
+}
+
+/* y[p] += a*x[p] for p = 0..n-1, every element on its own so the result
+ * does not depend on the vector width. */
+ALWAYS_INLINE void simd_axpy(double* y, const real_t* x, double a, int n) {
+  int p;
+#if SIMD
+  simd_v4_t va, vx, vy;
+
+  va = (simd_v4_t){a, a, a, a};
+  for (p = 0; p + 4 <= n; p += 4) {
+    simd_load4(&vx, x + p);
+    memcpy(&vy, y + p, sizeof(vy));
+    vy += va * vx;
+    memcpy(y + p, &vy, sizeof(vy));
+  }
+#else
+  p = 0;
+#endif
+  for (; p < n; p++) {
+    y[p] += a * x[p];
+  }
+}
+
+#endif
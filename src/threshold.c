@@ -19,54 +19,28 @@
 
 #include "threshold.h"
 
-threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image) {
-  int i,j;
-  int k,l;
-  double s;
-  int x, y, r;
+/* The threshold is the correlation of the image with the blur mask,
+ * through overlap-save FFT blocks for large masks. */
+static threshold_t* threshold_create(threshold_t* threshold, convmask_t* convmask, image_t* image, int mirror) {
+  image_t dst;
 
-  threshold->x = x = image->x;
-  threshold->y = y = image->y;
-  r = convmask->radius;
-  if (!(threshold->data = (double*)malloc(sizeof(double) * x * y)))
+  threshold->x = dst.x = image->x;
+  threshold->y = dst.y = image->y;
+  if (!(threshold->data = dst.data = (real_t*)malloc(sizeof(real_t) * dst.x * dst.y)))
+    return NULL;
+  if (!(image_correlate(&dst, image, convmask->coef, convmask->radius, mirror, NULL))) {
+    free(threshold->data);
     return NULL;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (k = -r; k <= r; k++) {
-        for (l = -r; l <= r; l++) {
-          s += convmask_get(convmask, k, l) * image_get_mirror(image, k + i, l + j);
-        }
-      }
-      threshold->data[j * x + i] = s;
-    }
   }
   return threshold;
 }
 
-threshold_t* threshold_create_period(threshold_t* threshold, convmask_t* convmask, image_t* image) {
-  int i,j;
-  int k,l;
-  double s;
-  int x, y, r;
+threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image) {
+  return threshold_create(threshold, convmask, image, 1);
+}
 
-  threshold->x = x = image->x;
-  threshold->y = y = image->y;
-  r = convmask->radius;
-  if (!(threshold->data = (double*)malloc(sizeof(double) * x * y)))
-    return NULL;
-  for (i = 0; i < x; i++) {
-    for (j = 0; j < y; j++) {
-      s = 0.0;
-      for (k = -r; k <= r; k++) { 
-        for (l = -r; l <= r; l++) {
-          s += convmask_get(convmask, k, l) * image_get_period(image, k + i, l + j);
-        }
-      }
-      threshold->data[j * x + i] = s;
-    }
-  }
-  return threshold;
+threshold_t* threshold_create_period(threshold_t* threshold, convmask_t* convmask, image_t* image) {
+  return threshold_create(threshold, convmask, image, 0);
 }
 
 void threshold_destroy(threshold_t* threshold) {
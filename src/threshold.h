@@ -29,7 +29,7 @@ C_DECL_BEGIN
 typedef struct {
   int     x;
   int     y;
-  double *data;
+  real_t *data;
 } threshold_t;
 
 threshold_t* threshold_create_mirror(threshold_t* threshold, convmask_t* convmask, image_t* image);
@@ -16,42 +16,61 @@
  */
 
 #include "weights.h"
+#include "fft.h"
 
 static void weights_set(weights_t* weights, int x, int y, double value) {
   weights->w[(weights->r2 + y) * weights->size + (weights->r2 + x)] = value;
   weights->w[weights->stride + y * weights->size + x] = value;
 }
 
-weights_t* weights_create(weights_t* weights, convmask_t* convmask) {
-  int r, r2, i, j, k, l;
-  int rxnz, rynz;
-  double s;
-  int size;
+/* Largest power of two scale keeping |wq| within 16 bit and 255 * sum |wq|
+ * within 32 bit. Only fixed point sweeps need the taps. */
+weights_t* weights_create_fixed(weights_t* weights) {
+  int i, j, n;
+  double w, wmax, wsum, scale;
 
-  rxnz = rynz = 0;
-  r = convmask->radius;
-  weights->r2 = r2 = 2 * r;
-  weights->size = size = 2*r2 + 1;
-  weights->stride = r2 * (size + 1);
-  if (!(weights->w = (double*)malloc(sizeof(double) * size * size))) {
-#if defined(NDEBUG)
-    printf("Error, weights_create() - Out of memory!\n");
-#endif
+  weights->qstride = (2 * weights->rxnz + 1 <= 16 ? 16 : (2 * weights->rxnz + 1 + 31) & ~31);
+  n = (2 * weights->rxnz + 1) * (2 * weights->rynz + 1);
+  if (!(weights->wq = (short*)calloc((size_t)weights->qstride * (2 * weights->rynz + 1), sizeof(short))))
     return NULL;
+  wmax = wsum = 0.0;
+  for (j = -weights->rynz; j <= weights->rynz; j++) {
+    for (i = -weights->rxnz; i <= weights->rxnz; i++) {
+      w = fabs(weights_get(weights, i, j));
+      if (w > wmax) wmax = w;
+      wsum += w;
+    }
   }
+  scale = 1.0 / 1073741824.0; /* 2^-30 */
+  while (scale < 1.0 && (wmax / scale + 0.5 > 32767.0 || 255.0 * (wsum / scale + 0.5 * n) > 2147483647.0)) {
+    scale *= 2.0;
+  }
+  for (j = -weights->rynz; j <= weights->rynz; j++) {
+    for (i = -weights->rxnz; i <= weights->rxnz; i++) {
+      weights->wq[(weights->rynz + j) * weights->qstride + weights->rxnz + i] =
+        (short)floor(weights_get(weights, i, j) / scale + 0.5);
+    }
+  }
+  weights->qscale = scale;
+  weights->qerror = 0.5 * scale * n;
+  return weights;
+}
 
-  for (i = 0; i <= r2; i++) {
-    for (j = 0; j <= r2; j++) {
+/* w(i,j) = -sum of c(k,l) * c(k+i,l+j), the point symmetry w(i,j) =
+ * w(-i,-j) halves the sums. */
+static void weights_correlate(weights_t* weights, convmask_t* convmask) {
+  int r, i, j, k, l;
+  double s;
+
+  r = convmask->radius;
+  for (i = 0; i <= weights->r2; i++) {
+    for (j = 0; j <= weights->r2; j++) {
       s = 0.0;
       for (k = -r; k <= r-i; k++) {
         for (l = -r; l <= r-j; l++) {
           s -= convmask_get(convmask, k, l) * convmask_get(convmask, k+i, l+j);
         }
       }
-      if (fabs(s) > 1e-6) {
-        if (i > rxnz) rxnz = i;
-        if (j > rynz) rynz = j;
-      }
       weights_set(weights,  i,  j, s);
       weights_set(weights, -i, -j, s);
 
@@ -61,23 +80,131 @@ weights_t* weights_create(weights_t* weights, convmask_t* convmask) {
           s -= convmask_get(convmask, k, l+j) * convmask_get(convmask, k+i, l);
         }
       }
-      if (fabs(s) > 1e-6) {
-        if (i > rxnz) rxnz = i;
-        if (j > rynz) rynz = j;
-      }
       weights_set(weights, -i,  j, s);
       weights_set(weights,  i, -j, s);
     }
   }
+}
 
+/* The same sums as the inverse transform of |C|^2, on a plane of at
+ * least size = 4r+1 so that the lags do not alias. */
+static weights_t* weights_correlate_fft(weights_t* weights, convmask_t* convmask) {
+  fft_t fft;
+  double* z;
+  int n, r, i, j, k;
+
+  n = fft_size(weights->size);
+  if (!(fft_create(&fft, n)))
+    return NULL;
+  if (!(z = fft_plane(&fft))) {
+    fft_destroy(&fft);
+    return NULL;
+  }
+  r = convmask->radius;
+  for (j = -r; j <= r; j++) {
+    for (i = -r; i <= r; i++) {
+      z[2 * (((j + n) % n) * n + (i + n) % n)] = convmask_get(convmask, i, j);
+    }
+  }
+  fft_2d(&fft, z, 0);
+  for (k = 0; k < n * n; k++) {
+    z[2 * k] = z[2 * k] * z[2 * k] + z[2 * k + 1] * z[2 * k + 1];
+    z[2 * k + 1] = 0.0;
+  }
+  fft_2d(&fft, z, 1);
+  for (j = -weights->r2; j <= weights->r2; j++) {
+    for (i = -weights->r2; i <= weights->r2; i++) {
+      weights_set(weights, i, j, -z[2 * (((j + n) % n) * n + (i + n) % n)]);
+    }
+  }
+  free(z);
+  fft_destroy(&fft);
+  return weights;
+}
+
+/* Large masks are correlated through the FFT when its two transforms cost
+ * less than the direct sums, about size^4 / 2 multiply-adds. */
+weights_t* weights_create(weights_t* weights, convmask_t* convmask) {
+  int r, r2, i, j;
+  int rxnz, rynz;
+  int size;
+
+  rxnz = rynz = 0;
+  r = convmask->radius;
+  weights->r2 = r2 = 2 * r;
+  weights->size = size = 2*r2 + 1;
+  weights->stride = r2 * (size + 1);
+  weights->wq = NULL;
+  weights->qscale = weights->qerror = 0.0;
+  if (!(weights->refs = (int*)malloc(sizeof(int)))) {
+#if defined(NDEBUG)
+    printf("Error, weights_create() - Out of memory!\n");
+#endif
+    return NULL;
+  }
+  if (!(weights->w = (real_t*)malloc(sizeof(real_t) * size * size))) {
+#if defined(NDEBUG)
+    printf("Error, weights_create() - Out of memory!\n");
+#endif
+    free(weights->refs);
+    return NULL;
+  }
+  *(weights->refs) = 1;
+
+  if (2.0 * fft_cost(fft_size(size)) >= 0.5 * pow(convmask->r21, 4.0))
+    weights_correlate(weights, convmask);
+  else if (!weights_correlate_fft(weights, convmask))
+    goto weights_create_err;
+
+  for (i = -r2; i <= r2; i++) {
+    for (j = -r2; j <= r2; j++) {
+      if (fabs(weights_get(weights, i, j)) > 1e-6) {
+        if (abs(i) > rxnz) rxnz = abs(i);
+        if (abs(j) > rynz) rynz = abs(j);
+      }
+    }
+  }
   weights->rxnz = rxnz;
   weights->rynz = rynz;
+  /* the kernels with a square tap radius and the FFT field read the taps
+   * up to the larger radius, make them agree with the exact radii */
+  for (i = -r2; i <= r2; i++) {
+    for (j = -r2; j <= r2; j++) {
+      if (abs(i) > rxnz || abs(j) > rynz)
+        weights_set(weights, i, j, 0.0);
+    }
+  }
+  return weights;
 
+weights_create_err:
+#if defined(NDEBUG)
+  printf("Error, weights_create() - Out of memory!\n");
+#endif
+  free(weights->w);
+  free(weights->refs);
+  return NULL;
+}
+
+/* Another holder of the taps of src, they depend on the blur mask only
+ * and its autocorrelation is too costly to repeat for every channel. */
+weights_t* weights_share(weights_t* weights, weights_t* src) {
+  *weights = *src;
+  weights->wq = NULL;
+  weights->qscale = weights->qerror = 0.0;
+  (*(weights->refs))++;
   return weights;
 }
 
+/* Leaves nothing behind, destroying it twice is fine. */
 void weights_destroy(weights_t* weights) {
-  free(weights->w);
+  if (weights->refs && --(*(weights->refs)) == 0) {
+    free(weights->w);
+    free(weights->refs);
+  }
+  free(weights->wq);
+  weights->w = NULL;
+  weights->wq = NULL;
+  weights->refs = NULL;
 }
 
 double weights_get(weights_t* weights, int x, int y) {
@@ -88,7 +215,8 @@ double weights_get(weights_t* weights, int x, int y) {
 void weights_print(weights_t* weights, char* str) {
   int i, j;
 
-  printf("WEIGHTS=%s: (rxnz, rynz)=(%d,%d)\n", str, weights->rxnz, weights->rynz);
+  printf("WEIGHTS=%s: (rxnz, rynz)=(%d,%d), fixed point scale %g, error %g\n", str, weights->rxnz, weights->rynz,
+         weights->qscale, weights->qerror);
   for (j = -weights->r2; j <= weights->r2; j++) {
     for (i = -weights->r2; i <= weights->r2; i++) {
       printf(" %3.3g", weights_get(weights, i, j));
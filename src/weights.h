@@ -23,15 +23,34 @@
 
 C_DECL_BEGIN
 
+/* wq holds the nonzero taps in fixed point, w ~ wq * qscale with a power
+ * of two qscale as fine as 16 bit allows while any sum of wq[p] * level
+ * for levels 0..255 still fits 32 bits. Row y starts with x = -rxnz at
+ * wq + (rynz + y) * qstride and is padded with zeros to 16 or a multiple
+ * of 32 taps.
+ * Every weight is at most qscale/2 off, so for states in 0..1 a local
+ * field is at most qerror = qscale/2 * (2*rxnz+1) * (2*rynz+1) off.
+ * Only weights_create_fixed() builds wq, for fixed point sweeps.
+ * Copies made by weights_share() use the same taps w, refs counts the
+ * holders and the last weights_destroy() frees them. wq belongs to the
+ * holder which built it and is not shared.
+ * rxnz and rynz bound the taps above 1e-6, the taps outside are zero. */
 typedef struct {
-  double *w;
+  real_t *w;
+  short  *wq;
+  int     qstride;
+  double  qscale;
+  double  qerror;
   int     r2;
   int     rxnz, rynz;
   int     stride;
   int     size;
+  int    *refs;
 } weights_t;
 
 weights_t* weights_create(weights_t* weights, convmask_t* convmask);
+weights_t* weights_share(weights_t* weights, weights_t* src);
+weights_t* weights_create_fixed(weights_t* weights);
 void weights_destroy(weights_t* weights);
 double weights_get(weights_t* weights, int x, int y);
 
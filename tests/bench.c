@@ -0,0 +1,221 @@
+/*
+ * Sweep kernel and wide frame benchmark for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Built by make bench, not run by make check. bench kernels times the
+ * sweep kernels, bench widths the passes over 4K and 8K wide frames, no
+ * argument both. The instruction set is the widest of the host,
+ * REFOCUS_IT_ISA=generic, avx2 or avx512 asks for a narrower one, so a
+ * speedup is the ratio of two runs. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "blur.h"
+#include "hopfield.h"
+#include "lambda.h"
+#include "threshold.h"
+#include "cpu.h"
+
+#define KERNEL_SIZE    256
+#define KERNEL_REPEATS 3
+#define WIDE_ROWS      2160
+
+static double bench_time(void) {
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Noise on the 256 levels, the same on every run. */
+static void noise_create(image_t* image, int x, int y) {
+  int k;
+
+  image_create(image, x, y);
+  for (k = 0; k < x * y; k++) {
+    image->data[k] = (((uint32_t)k * 2654435761u) >> 24) / 255.0;
+  }
+}
+
+enum {
+  KERNEL_DIRECT,
+  KERNEL_FIELD,
+  KERNEL_QUANTIZED,
+  KERNEL_FIXED_POINT,
+  KERNEL_SYNCHRONOUS,
+  KERNEL_LAST
+};
+
+static const char* kernel_names[KERNEL_LAST] = {
+  "direct", "field", "quantized", "fixed point", "synchronous"
+};
+
+/* ns/pixel of sweeps of the given kernel on one thread, the least of
+ * KERNEL_REPEATS runs from the same noise, set up outside the timing. */
+static double bench_kernel(image_t* noise, convmask_t* blur, int kernel, int sweeps, int* rxnz) {
+  hopfield_t hopfield;
+  image_t image;
+  double t, best;
+  int k, it;
+
+  best = -1.0;
+  image_create_copyparam(&image, noise);
+  for (k = 0; k < KERNEL_REPEATS; k++) {
+    memcpy(image.data, noise->data, sizeof(real_t) * image.x * image.y);
+    memset(&hopfield, 0, sizeof(hopfield));
+    hopfield.lambda = 0.01;
+    hopfield_set_mirror(&hopfield, 1);
+    hopfield_set_threads(&hopfield, 1);
+    hopfield_set_incremental(&hopfield, kernel == KERNEL_FIELD);
+    hopfield_set_quantized(&hopfield, kernel == KERNEL_QUANTIZED);
+    hopfield_set_fixed_point(&hopfield, kernel == KERNEL_FIXED_POINT);
+    hopfield_set_synchronous(&hopfield, kernel == KERNEL_SYNCHRONOUS);
+    if (!hopfield_create(&hopfield, blur, &image, NULL))
+      break;
+    *rxnz = hopfield.weights.rxnz;
+    t = bench_time();
+    for (it = 0; it < sweeps; it++) {
+      hopfield_iteration(&hopfield);
+    }
+    t = (bench_time() - t) * 1e9 / ((double)sweeps * image.x * image.y);
+    if (best < 0.0 || t < best)
+      best = t;
+    hopfield_destroy(&hopfield);
+  }
+  image_destroy(&image);
+  return best;
+}
+
+/* Every kernel at defocus radius 3, 6, 12 and 24. */
+static void bench_kernels(void) {
+  static const double radius[] = { 3.0, 6.0, 12.0, 24.0 };
+  image_t noise;
+  convmask_t blur;
+  double ns;
+  int n, kernel, rxnz;
+
+  printf("Sweep kernels, %s, %dx%d noise, one thread, ns/pixel per sweep\n", cpu_isa_name(cpu_isa()),
+         KERNEL_SIZE, KERNEL_SIZE);
+  printf("%-12s %4s %5s %10s\n", "kernel", "r", "rxnz", "ns/pixel");
+  noise_create(&noise, KERNEL_SIZE, KERNEL_SIZE);
+  for (kernel = 0; kernel < KERNEL_LAST; kernel++) {
+    for (n = 0; n < (int)(sizeof(radius) / sizeof(radius[0])); n++) {
+      blur_create_defocus(&blur, radius[n]);
+      rxnz = 0;
+      ns = bench_kernel(&noise, &blur, kernel, (radius[n] < 12.0 ? 3 : 1), &rxnz);
+      printf("%-12s %4.0f %5d %10.1f\n", kernel_names[kernel], radius[n], rxnz, ns);
+      convmask_destroy(&blur);
+    }
+  }
+  image_destroy(&noise);
+}
+
+static double bench_ns(double t, image_t* image, int n) {
+  return t * 1e9 / ((double)n * image->x * image->y);
+}
+
+/* The row by row passes on 4K and 8K wide frames, a defocus blur of
+ * radius 4 and the adaptive lambda of the plug-in. The sweeps run on one
+ * thread after one sweep to warm up, with and without the field. */
+static void bench_widths(void) {
+  static const int width[] = { 4096, 8192 };
+  image_t image, dst;
+  convmask_t blur, filter;
+  threshold_t threshold;
+  lambda_t lambda;
+  hopfield_t hopfield;
+  double t;
+  int n, field;
+
+  printf("Wide frames, %s, %d rows of noise, one thread, ns/pixel\n", cpu_isa_name(cpu_isa()), WIDE_ROWS);
+  printf("%-6s %10s %10s %10s %10s %10s\n", "width", "convolve", "threshold", "variance", "sweep", "field");
+  blur_create_defocus(&blur, 4.0);
+  blur_create_gauss(&filter, 1.0);
+  for (n = 0; n < (int)(sizeof(width) / sizeof(width[0])); n++) {
+    noise_create(&image, width[n], WIDE_ROWS);
+    printf("%-6d", width[n]);
+
+    image_create_copyparam(&dst, &image);
+    t = bench_time();
+    image_convolve_mirror(&dst, &image, &blur, NULL);
+    printf(" %10.1f", bench_ns(bench_time() - t, &image, 1));
+    image_destroy(&dst);
+
+    t = bench_time();
+    threshold_create_mirror(&threshold, &blur, &image);
+    printf(" %10.1f", bench_ns(bench_time() - t, &image, 1));
+    threshold_destroy(&threshold);
+
+    lambda_set_mirror(&lambda, 1);
+    lambda_set_nl(&lambda, 1);
+    lambda_create(&lambda, image.x, image.y, 0.3, 3, &filter);
+    t = bench_time();
+    lambda_calculate(&lambda, &image);
+    printf(" %10.1f", bench_ns(bench_time() - t, &image, 1));
+
+    for (field = 0; field < 2; field++) {
+      memset(&hopfield, 0, sizeof(hopfield));
+      hopfield.lambda = 0.01;
+      hopfield_set_mirror(&hopfield, 1);
+      hopfield_set_threads(&hopfield, 1);
+      hopfield_set_incremental(&hopfield, field);
+      if (!hopfield_create(&hopfield, &blur, &image, &lambda)) {
+        printf(" %10s", "-");
+        continue;
+      }
+      hopfield_iteration(&hopfield);
+      t = bench_time();
+      hopfield_iteration(&hopfield);
+      hopfield_iteration(&hopfield);
+      printf(" %10.1f", bench_ns(bench_time() - t, &image, 2));
+      hopfield_destroy(&hopfield);
+    }
+    printf("\n");
+    fflush(stdout);
+    lambda_destroy(&lambda);
+    image_destroy(&image);
+  }
+  convmask_destroy(&filter);
+  convmask_destroy(&blur);
+}
+
+/* Both sections, or those named on the command line in their order. */
+int main(int argc, char** argv) {
+  int k;
+
+  if (argc < 2) {
+    bench_kernels();
+    bench_widths();
+    return 0;
+  }
+  for (k = 1; k < argc; k++) {
+    if (!strcmp(argv[k], "kernels")) {
+      bench_kernels();
+    } else if (!strcmp(argv[k], "widths")) {
+      bench_widths();
+    } else {
+      fprintf(stderr, "usage: %s [kernels] [widths]\n", argv[0]);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * FFT correlations test for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "blur.h"
+#include "weights.h"
+#include "image.h"
+
+/* Largest difference to the plain sums, relative to their largest value.
+ * Float builds store the results in float. */
+#define TOLERANCE (sizeof(real_t) == sizeof(float) ? 1e-6 : 1e-12)
+
+static int check(const char* name, double err, double scale) {
+  int rv;
+
+  err /= (scale > 0.0 ? scale : 1.0);
+  rv = !(err <= TOLERANCE);
+  printf("%s %s: relative error %.3g\n", rv ? "FAIL" : "ok  ", name, err);
+  return rv;
+}
+
+static double mask_get(convmask_t* c, int i, int j) {
+  return ((abs(i) <= c->radius && abs(j) <= c->radius) ? convmask_get(c, i, j) : 0.0);
+}
+
+/* Defocus combined with a Gaussian, as the plug-in does it. */
+static int test_combine(double radius, double variance) {
+  convmask_t defocus, gauss, ct;
+  double s, err, scale;
+  int x, y, k, l, rv;
+  char name[64];
+
+  blur_create_defocus(&defocus, radius);
+  blur_create_gauss(&gauss, variance);
+  if (!convmask_convolve(&ct, &defocus, &gauss)) {
+    printf("FAIL convmask_convolve()\n");
+    return 1;
+  }
+  err = scale = 0.0;
+  for (y = -ct.radius; y <= ct.radius; y++) {
+    for (x = -ct.radius; x <= ct.radius; x++) {
+      s = 0.0;
+      for (l = -gauss.radius; l <= gauss.radius; l++) {
+        for (k = -gauss.radius; k <= gauss.radius; k++) {
+          s += mask_get(&defocus, x - k, y - l) * convmask_get(&gauss, k, l);
+        }
+      }
+      err = fmax(err, fabs(convmask_get(&ct, x, y) - s));
+      scale = fmax(scale, fabs(s));
+    }
+  }
+  snprintf(name, sizeof(name), "combine defocus %.1f gauss %.1f", radius, variance);
+  rv = check(name, err, scale);
+  convmask_destroy(&ct);
+  convmask_destroy(&gauss);
+  convmask_destroy(&defocus);
+  return rv;
+}
+
+/* w(i,j) = -sum of c(k,l) * c(k+i,l+j) within the nonzero radii, the
+ * taps outside them are zero and the sums there at most 1e-6. */
+static int test_weights(double radius) {
+  convmask_t c;
+  weights_t w;
+  double s, err, scale;
+  int i, j, k, l, rv, outside;
+  char name[64];
+
+  blur_create_defocus(&c, radius);
+  if (!weights_create(&w, &c)) {
+    printf("FAIL weights_create()\n");
+    return 1;
+  }
+  outside = 0;
+  err = scale = 0.0;
+  for (j = -w.r2; j <= w.r2; j++) {
+    for (i = -w.r2; i <= w.r2; i++) {
+      s = 0.0;
+      for (l = -c.radius; l <= c.radius; l++) {
+        for (k = -c.radius; k <= c.radius; k++) {
+          s -= convmask_get(&c, k, l) * mask_get(&c, k + i, l + j);
+        }
+      }
+      if (abs(i) > w.rxnz || abs(j) > w.rynz) {
+        outside |= (weights_get(&w, i, j) != 0.0 || fabs(s) > 1e-6);
+        continue;
+      }
+      err = fmax(err, fabs(weights_get(&w, i, j) - s));
+      scale = fmax(scale, fabs(s));
+    }
+  }
+  snprintf(name, sizeof(name), "weights defocus %.1f", radius);
+  rv = check(name, err, scale);
+  if (outside) {
+    printf("FAIL %s: taps outside the nonzero radii\n", name);
+    rv = 1;
+  }
+  weights_destroy(&w);
+  convmask_destroy(&c);
+  return rv;
+}
+
+/* The threshold correlates the image with a mask through image_correlate(),
+ * by overlap-save FFT wherever image_correlate_fft_size() says so, which
+ * must agree with fft. */
+static int test_correlate(int x, int y, int r, int mirror, int fft) {
+  image_t src, dst;
+  double *mask, s, v, err, scale;
+  int i, j, k, l, n, rv;
+  char name[96];
+
+  n = 2 * r + 1;
+  mask = (double*)malloc(sizeof(double) * n * n);
+  image_create(&src, x, y);
+  image_create(&dst, x, y);
+  srand(r * 2 + mirror);
+  for (k = 0; k < n * n; k++) {
+    mask[k] = rand() / (double)RAND_MAX - 0.5;
+  }
+  for (k = 0; k < x * y; k++) {
+    src.data[k] = (rand() % 256) / 255.0;
+  }
+  if (!image_correlate(&dst, &src, mask, r, mirror, NULL)) {
+    printf("FAIL image_correlate()\n");
+    return 1;
+  }
+  err = scale = 0.0;
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      s = 0.0;
+      for (l = -r; l <= r; l++) {
+        for (k = -r; k <= r; k++) {
+          v = (mirror ? image_get_mirror(&src, i + k, j + l) : image_get_period(&src, i + k, j + l));
+          s += mask[(l + r) * n + k + r] * v;
+        }
+      }
+      err = fmax(err, fabs(image_get(&dst, i, j) - s));
+      scale = fmax(scale, fabs(s));
+    }
+  }
+  snprintf(name, sizeof(name), "correlate %dx%d r=%d %s%s", x, y, r, mirror ? "mirror" : "period",
+           image_correlate_fft_size(x, y, r) ? " (fft)" : "");
+  rv = check(name, err, scale);
+  if ((image_correlate_fft_size(x, y, r) != 0) != fft) {
+    printf("FAIL %s: wrong route\n", name);
+    rv = 1;
+  }
+  image_destroy(&dst);
+  image_destroy(&src);
+  free(mask);
+  return rv;
+}
+
+/* Each case is far enough on its side of the switch between the direct
+ * sums and the FFT that both are checked. */
+int main(void) {
+  int rv, mirror;
+
+  rv = test_combine(2.0, 1.0);
+  rv |= test_combine(20.0, 10.0);
+  rv |= test_weights(2.0);
+  rv |= test_weights(20.0);
+  for (mirror = 1; mirror >= 0; mirror--) {
+    rv |= test_correlate(97, 61, 2, mirror, 0);
+    rv |= test_correlate(40, 30, 32, mirror, 0);
+    rv |= test_correlate(97, 61, 20, mirror, 1);
+    rv |= test_correlate(200, 150, 32, mirror, 1);
+  }
+  return rv;
+}
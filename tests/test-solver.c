@@ -0,0 +1,238 @@
+/*
+ * Hopfield solver modes test for refocus-it.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "blur.h"
+#include "hopfield.h"
+
+#define WIDTH      160
+#define HEIGHT     144
+#define ITERATIONS 30
+#define LAMBDA_ITERATIONS 150 /* the variance range holds still late */
+
+/* Squares and a ramp on a dark background, on the 256 levels, in the top
+ * left corner of an x by y image. */
+static void sharp_create(image_t* image, int x, int y) {
+  int i, j, v;
+
+  image_create(image, x, y);
+  for (j = 0; j < y; j++) {
+    for (i = 0; i < x; i++) {
+      v = 40;
+      if (i > 12 && i < 40 && j > 10 && j < 36) v = 220;
+      if (i > 50 && i < 84 && j > 44 && j < 70) v = 40 + 2 * (i - 50);
+      if ((i - 30) * (i - 30) + (j - 58) * (j - 58) < 100) v = 160;
+      image_set(image, i, j, v / 255.0);
+    }
+  }
+}
+
+static double distance(image_t* a, image_t* b) {
+  int k;
+  double d, s;
+
+  s = 0.0;
+  for (k = 0; k < a->x * a->y; k++) {
+    d = a->data[k] - b->data[k];
+    s += d * d;
+  }
+  return sqrt(s / (a->x * a->y));
+}
+
+enum {
+  MODE_SYNCHRONOUS = 1,
+  MODE_QUANTIZED   = 2,
+  MODE_FIXED_POINT = 4,
+  MODE_INCREMENTAL = 8,
+  MODE_THREADS     = 16
+};
+
+/* Restores the blurred image in the given mode, which must bring it
+ * closer to the sharp one. Synchronous runs must take the FFT field if
+ * and only if fft is set, and keep the damping setting. Fixed point runs
+ * must sum the 16 bit taps and never a field, no other run may build
+ * those taps. */
+static int run(const char* name, image_t* sharp, image_t* blurred, convmask_t* blur, int mirror, int mode, int fft,
+               image_t* result) {
+  hopfield_t hopfield;
+  image_t image;
+  double before, after;
+  int it, rv;
+
+  memset(&hopfield, 0, sizeof(hopfield));
+  image_create_copyparam(&image, blurred);
+  memcpy(image.data, blurred->data, sizeof(real_t) * image.x * image.y);
+  hopfield.lambda = 0.001;
+  hopfield_set_mirror(&hopfield, mirror);
+  hopfield_set_incremental(&hopfield, (mode & MODE_INCREMENTAL) != 0);
+  hopfield_set_threads(&hopfield, (mode & MODE_THREADS) ? 4 : 1);
+  hopfield_set_synchronous(&hopfield, (mode & MODE_SYNCHRONOUS) != 0);
+  hopfield_set_quantized(&hopfield, (mode & MODE_QUANTIZED) != 0);
+  hopfield_set_fixed_point(&hopfield, (mode & MODE_FIXED_POINT) != 0);
+  if (!hopfield_create(&hopfield, blur, &image, NULL)) {
+    printf("FAIL %s: hopfield_create()\n", name);
+    image_destroy(&image);
+    return 1;
+  }
+  for (it = 0; it < ITERATIONS; it++) {
+    hopfield_iteration(&hopfield);
+  }
+  before = distance(blurred, sharp);
+  after = distance(&image, sharp);
+  rv = !(after < 0.8 * before);
+  if ((mode & MODE_SYNCHRONOUS) && (hopfield.fft.n != 0) != fft)
+    rv = 1;
+  /* the damping setting stays for copies made for other masks */
+  if ((mode & MODE_SYNCHRONOUS) && (hopfield.damping != 0.0 || !(hopfield.step > 0.0)))
+    rv = 1;
+  if ((mode & MODE_FIXED_POINT) ? (hopfield.field || !hopfield.weights.wq) : hopfield.weights.wq != NULL)
+    rv = 1;
+  printf("%s %s: rms %.4f -> %.4f%s\n", rv ? "FAIL" : "ok  ", name, before, after, hopfield.fft.n ? " (fft)" : "");
+  hopfield_destroy(&hopfield);
+  if (result)
+    memcpy(result->data, image.data, sizeof(real_t) * image.x * image.y);
+  image_destroy(&image);
+  return rv;
+}
+
+/* The in place sweep must give the same image on one thread or many. */
+static int run_blur(double radius, int mirror, int fft) {
+  image_t sharp, blurred, single, threads;
+  convmask_t blur;
+  char name[64];
+  int rv;
+
+  sharp_create(&sharp, WIDTH, HEIGHT);
+  image_create_copyparam(&blurred, &sharp);
+  image_create_copyparam(&single, &sharp);
+  image_create_copyparam(&threads, &sharp);
+  blur_create_defocus(&blur, radius);
+  if (mirror) image_convolve_mirror(&blurred, &sharp, &blur, NULL);
+  else image_convolve_period(&blurred, &sharp, &blur, NULL);
+  rv = 0;
+#define RUN(str, mode, result) \
+  snprintf(name, sizeof(name), "r=%.1f %s %s", radius, mirror ? "mirror" : "period", str); \
+  rv |= run(name, &sharp, &blurred, &blur, mirror, mode, fft, result)
+  RUN("in place", 0, &single);
+  RUN("incremental", MODE_INCREMENTAL, NULL);
+  RUN("threads", MODE_THREADS, &threads);
+  RUN("synchronous", MODE_SYNCHRONOUS, NULL);
+  RUN("quantized", MODE_QUANTIZED, NULL);
+  RUN("fixed point", MODE_FIXED_POINT, NULL);
+  RUN("fixed point incremental", MODE_FIXED_POINT | MODE_INCREMENTAL, NULL);
+  RUN("synchronous quantized", MODE_SYNCHRONOUS | MODE_QUANTIZED, NULL);
+#undef RUN
+  if (memcmp(single.data, threads.data, sizeof(real_t) * single.x * single.y)) {
+    printf("FAIL r=%.1f %s: threads change the result\n", radius, mirror ? "mirror" : "period");
+    rv = 1;
+  }
+  convmask_destroy(&blur);
+  image_destroy(&threads);
+  image_destroy(&single);
+  image_destroy(&blurred);
+  image_destroy(&sharp);
+  return rv;
+}
+
+/* Adaptive smoothing with lambda calculated again before every sweep,
+ * tiles marked in full or only under the lambda blocks which moved. Both
+ * must give the same image, the second must mark fewer tiles. */
+static int run_lambda(int mirror, int targeted, image_t* blurred, convmask_t* blur, image_t* result, long* marked) {
+  hopfield_t hopfield;
+  lambda_t lambda;
+  convmask_t filter;
+  int it, t;
+
+  memcpy(result->data, blurred->data, sizeof(real_t) * result->x * result->y);
+  blur_create_gauss(&filter, 1.0);
+  lambda_set_mirror(&lambda, mirror);
+  lambda_set_nl(&lambda, 1);
+  if (!lambda_create(&lambda, result->x, result->y, 0.1, 3, &filter)) {
+    convmask_destroy(&filter);
+    return 1;
+  }
+  lambda_set_incremental(&lambda, 1);
+  memset(&hopfield, 0, sizeof(hopfield));
+  hopfield.lambda = 0.001;
+  hopfield_set_mirror(&hopfield, mirror);
+  hopfield_set_threads(&hopfield, 1);
+  hopfield_set_active(&hopfield, 1);
+  if (!hopfield_create(&hopfield, blur, result, &lambda)) {
+    lambda_destroy(&lambda);
+    convmask_destroy(&filter);
+    return 1;
+  }
+  *marked = 0;
+  for (it = 0; it < LAMBDA_ITERATIONS; it++) {
+    lambda_calculate(&lambda, result);
+    if (targeted) hopfield_invalidate_lambda(&hopfield);
+    else hopfield_invalidate(&hopfield);
+    for (t = 0; t < hopfield.tiles.nx * hopfield.tiles.ny; t++) {
+      *marked += hopfield.tiles.changed[t];
+    }
+    hopfield_iteration(&hopfield);
+  }
+  hopfield_destroy(&hopfield);
+  lambda_destroy(&lambda);
+  convmask_destroy(&filter);
+  return 0;
+}
+
+static int run_lambda_blur(int mirror) {
+  image_t sharp, blurred, full, targeted;
+  convmask_t blur;
+  long marked_full, marked_targeted;
+  int rv;
+
+  sharp_create(&sharp, 2 * WIDTH, 2 * HEIGHT);
+  image_create_copyparam(&blurred, &sharp);
+  image_create_copyparam(&full, &sharp);
+  image_create_copyparam(&targeted, &sharp);
+  blur_create_defocus(&blur, 2.5);
+  if (mirror) image_convolve_mirror(&blurred, &sharp, &blur, NULL);
+  else image_convolve_period(&blurred, &sharp, &blur, NULL);
+  rv = run_lambda(mirror, 0, &blurred, &blur, &full, &marked_full);
+  rv |= run_lambda(mirror, 1, &blurred, &blur, &targeted, &marked_targeted);
+  if (memcmp(full.data, targeted.data, sizeof(real_t) * full.x * full.y))
+    rv = 1;
+  if (!(marked_targeted < marked_full))
+    rv = 1;
+  printf("%s r=2.5 %s adaptive lambda: tiles marked %ld of %ld\n", rv ? "FAIL" : "ok  ",
+         mirror ? "mirror" : "period", marked_targeted, marked_full);
+  convmask_destroy(&blur);
+  image_destroy(&targeted);
+  image_destroy(&full);
+  image_destroy(&blurred);
+  image_destroy(&sharp);
+  return rv;
+}
+
+/* The threshold is always calculated with mirror boundaries, so periodic
+ * boundaries are only restored well for a blur much smaller than the
+ * image. The large blur takes the FFT field in synchronous mode. */
+int main(void) {
+  int rv;
+
+  rv = run_blur(2.5, 1, 0);
+  rv |= run_blur(2.5, 0, 0);
+  rv |= run_blur(8.0, 1, 1);
+  rv |= run_lambda_blur(1);
+  rv |= run_lambda_blur(0);
+  return rv;
+}